@@ -16,13 +16,13 @@ spi = SpiAdapter(port)
 spi.set_aux_pin_mode(aux_out_pin, AuxPinMode.OUTPUT)
 spi.set_aux_pin_mode(aux_in_pin, AuxPinMode.INPUT_PULLUP)
 
+# Changes of the input pin are reported by the adapter, no polling needed.
+spi.subscribe_aux_events(1 << aux_in_pin)
 
 i = 0
 while True:
   i += 1
   spi.write_aux_pin(aux_out_pin, i % 2)   # Square wave
-  in_value = spi.read_aux_pin(aux_in_pin)
-  print(f"{i:03d}: Input pin value: {in_value}", flush=True)
-  time.sleep(0.5)
-
-
+  for event in spi.get_aux_events(timeout=0.5):
+    in_value = bool(event.aux_values & (1 << aux_in_pin))
+    print(f"{i:03d}: Input pin value: {in_value} @ {event.timestamp_us} us", flush=True)
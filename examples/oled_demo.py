@@ -29,6 +29,8 @@ from PIL import ImageFont, ImageColor
 my_port = "COM18"
 dc_aux_pin = 0
 nrst_aux_pin = 1
+display_width = 128
+display_height = 64
 
 # my_oled_addr = 0x3C
 
@@ -54,6 +56,13 @@ class MyLumaSerial:
 
     def data(self, data):
         """Send to the SPI display data with given bytes."""
+        # A full frame is diffed by the SPI Adapter against the previous one, and
+        # only the changed columns are sent to the display.
+        if len(data) == display_width * display_height // 8:
+            assert self.__spi.update_display(
+                bytes(data), dc_aux_pin, display_width, display_height, speed=4000000
+            ) is not None
+            return
         self.__spi.write_aux_pins(1 << dc_aux_pin, 1 << dc_aux_pin)
         i = 0
         n = len(data)
@@ -66,7 +75,7 @@ class MyLumaSerial:
 
 
 luma_serial = MyLumaSerial(my_port)
-luma_device = ssd1306(luma_serial, width=128, height=64, rotate=0)
+luma_device = ssd1306(luma_serial, width=display_width, height=display_height, rotate=0)
 # luma_device.persist = True  # Do not clear display on exit
 
 
@@ -78,8 +87,8 @@ black = ImageColor.getcolor("black", "1")
 while True:
     time_str = "{0:%H:%M:%S}".format(datetime.datetime.now())
     print(f"Drawing {time_str}", flush=True)
-    # The canvas is drawn from scratch and is sent in its entirety to the display
-    # upon exiting the 'with' clause.
+    # The canvas is drawn from scratch and is sent to the SPI Adapter upon exiting
+    # the 'with' clause. Only the changed columns are sent to the display.
     with canvas(luma_device) as draw:
         draw.rectangle(luma_device.bounding_box, outline=white, fill=black)
         draw.text((20, 14), f"SPI Adapter", fill=white, font=font1)
@@ -0,0 +1,62 @@
+# PlatformIO pre build script of env:raspberry_pico_perf.
+#
+# The build_flags are passed to the compiler only, and LTO requires the
+# optimization flags also at link time.
+#
+# The env runs the command hot path from RAM, see src/time_critical.h. This
+# relies on the linker script of the core to copy the .time_critical.*
+# sections to RAM, so after linking we check their addresses in the map
+# file, and fail the build if any of them is not in RAM.
+
+import glob
+import os
+import re
+
+Import("env")
+
+# The RP2040 SRAM, including the scratch banks.
+RAM_START = 0x20000000
+RAM_END = 0x20042000
+
+map_path = os.path.join(env.subst("$BUILD_DIR"), "firmware.map")
+env.Append(LINKFLAGS=["-O2", "-flto", "-Wl,-Map=" + map_path])
+
+
+def time_critical_names() -> set:
+    """Returns the names of the TIME_CRITICAL functions in the sources."""
+    names = set()
+    for path in glob.glob(os.path.join(env.subst("$PROJECT_SRC_DIR"), "*.cpp")):
+        with open(path) as f:
+            names.update(re.findall(r"TIME_CRITICAL\(([\w:]+)\)", f.read()))
+    return names
+
+
+def time_critical_sections() -> list:
+    """Returns the name and address of the .time_critical.* input sections in the map
+    file. Functions that were inlined everywhere have no section."""
+    with open(map_path) as f:
+        text = f.read()
+    # Skip the list of discarded sections, which precedes the memory map.
+    text = text[text.find("Linker script and memory map") :]
+    pattern = re.compile(r"^ (\.time_critical\.\S+)\s+(0x[0-9a-fA-F]+)\s+0x[0-9a-fA-F]+", re.M)
+    return [(m.group(1), int(m.group(2), 16)) for m in pattern.finditer(text)]
+
+
+def check_time_critical_in_ram(source, target, env):
+    names = time_critical_names()
+    sections = [
+        (name, addr)
+        for name, addr in time_critical_sections()
+        if name[len(".time_critical.") :] in names
+    ]
+    not_in_ram = [(name, addr) for name, addr in sections if not RAM_START <= addr < RAM_END]
+    for name, addr in not_in_ram:
+        print(f"Error: {name} is at 0x{addr:08x}, not in RAM")
+    if not sections:
+        print(f"Error: no time critical functions found in {map_path}")
+    if not sections or not_in_ram:
+        env.Exit(1)
+    print(f"Time critical functions in RAM: {len(sections)}, see {map_path}")
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", check_time_critical_in_ram)
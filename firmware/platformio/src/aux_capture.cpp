@@ -0,0 +1,125 @@
+// Implementation of aux_capture.h
+
+#include "aux_capture.h"
+
+#include <Arduino.h>
+
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/pio_instructions.h"
+#include "pio_util.h"
+
+namespace aux_capture {
+
+// The PIO program. The first two instructions are rewritten by start()
+// to select the trigger pin and edge. Without a trigger, the state machine
+// starts at the 'in' instruction.
+//
+//    wait 0 gpio <n>   ; Wait for the inactive level of the trigger pin
+//    wait 1 gpio <n>   ; and then for its active level.
+//  .wrap_target
+//    in pins, 8        ; Take a sample, autopush every 4 samples.
+//  .wrap
+static constexpr uint kSampleInstruction = 2;
+static uint16_t program_instructions[3];
+static const pio_program_t program = {program_instructions, 3, -1};
+
+// Samples are transferred as 32 bits words, 4 samples per word.
+static uint32_t buffer[kMaxSamples / 4];
+
+// Allocated hardware resources.
+static pio_util::PioResources res;
+
+static uint8_t base_gpio_pin = 0;
+
+// Number of samples of the current capture.
+static uint32_t requested_samples = 0;
+
+// True if a capture was started and not stopped.
+static bool is_started = false;
+
+void setup(uint8_t first_gpio_pin) {
+  base_gpio_pin = first_gpio_pin;
+  program_instructions[0] = pio_encode_wait_gpio(false, first_gpio_pin);
+  program_instructions[1] = pio_encode_wait_gpio(true, first_gpio_pin);
+  program_instructions[2] = pio_encode_in(pio_pins, 8);
+}
+
+bool start(uint32_t sample_rate_hz, uint32_t num_samples, bool trigger,
+           uint8_t trigger_aux_pin, bool trigger_rising_edge) {
+  stop();
+  const uint32_t sys_clock_hz = clock_get_hz(clk_sys);
+  if (sample_rate_hz < kMinSampleRateHz || sample_rate_hz > kMaxSampleRateHz ||
+      sample_rate_hz > sys_clock_hz || num_samples < 4 ||
+      num_samples > kMaxSamples || (num_samples % 4) || trigger_aux_pin >= 8) {
+    return false;
+  }
+  if (!pio_util::allocate(&program, &res)) {
+    return false;
+  }
+
+  // Set the trigger instructions. The state machine is disabled.
+  const uint trigger_gpio_pin = base_gpio_pin + trigger_aux_pin;
+  res.pio->instr_mem[res.program_offset] =
+      pio_encode_wait_gpio(!trigger_rising_edge, trigger_gpio_pin);
+  res.pio->instr_mem[res.program_offset + 1] =
+      pio_encode_wait_gpio(trigger_rising_edge, trigger_gpio_pin);
+
+  const uint sample_pc = res.program_offset + kSampleInstruction;
+  pio_sm_config c = pio_get_default_sm_config();
+  sm_config_set_wrap(&c, sample_pc, sample_pc);
+  sm_config_set_in_pins(&c, base_gpio_pin);
+  sm_config_set_in_shift(&c, true, true, 32);
+  sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+  sm_config_set_clkdiv(&c, (float)sys_clock_hz / sample_rate_hz);
+  pio_sm_init(res.pio, res.sm, trigger ? res.program_offset : sample_pc, &c);
+
+  dma_channel_config dc = dma_channel_get_default_config(res.dma_channel);
+  channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+  channel_config_set_read_increment(&dc, false);
+  channel_config_set_write_increment(&dc, true);
+  channel_config_set_dreq(&dc, pio_get_dreq(res.pio, res.sm, false));
+  dma_channel_configure(res.dma_channel, &dc, buffer, &res.pio->rxf[res.sm],
+                        num_samples / 4, true);
+
+  requested_samples = num_samples;
+  is_started = true;
+  pio_sm_set_enabled(res.pio, res.sm, true);
+  return true;
+}
+
+void stop() {
+  if (!is_started) {
+    return;
+  }
+  pio_sm_set_enabled(res.pio, res.sm, false);
+  dma_channel_abort(res.dma_channel);
+  is_started = false;
+  requested_samples = 0;
+}
+
+State state() {
+  if (!is_started) {
+    return kIdle;
+  }
+  if (!dma_channel_is_busy(res.dma_channel)) {
+    pio_sm_set_enabled(res.pio, res.sm, false);
+    return kDone;
+  }
+  const uint pc = pio_sm_get_pc(res.pio, res.sm);
+  return (pc < res.program_offset + kSampleInstruction) ? kArmed : kCapturing;
+}
+
+uint32_t samples_captured() {
+  if (!is_started) {
+    return 0;
+  }
+  const uint32_t words_left =
+      dma_channel_hw_addr(res.dma_channel)->transfer_count;
+  return requested_samples - (words_left * 4);
+}
+
+const uint8_t* samples() { return (const uint8_t*)buffer; }
+
+}  // namespace aux_capture
@@ -0,0 +1,53 @@
+// Aux pins logic analyzer. Samples the eight aux pins at a configurable
+// rate into a RAM buffer, using a PIO state machine and DMA, with an
+// optional edge trigger.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace aux_capture {
+
+// Size of the capture buffer. One byte per sample.
+static constexpr uint32_t kMaxSamples = 64 * 1024;
+
+// Range of the sample rate, in Hz. The max rate is also limited by the
+// system clock.
+static constexpr uint32_t kMinSampleRateHz = 2000;
+static constexpr uint32_t kMaxSampleRateHz = 125000000;
+
+// Capture state. Numeric values match the wire protocol.
+enum State : uint8_t {
+  kIdle = 0,
+  // Waiting for the trigger.
+  kArmed = 1,
+  kCapturing = 2,
+  // Samples are available.
+  kDone = 3,
+};
+
+// Called once on startup. The eight aux pins are expected to be consecutive
+// gpio pins, starting with first_gpio_pin.
+extern void setup(uint8_t first_gpio_pin);
+
+// Starts a new capture, aborting the current one, if any. num_samples
+// should be a multiple of 4, in the range [4, kMaxSamples]. If trigger is
+// true, the capture starts on the first rising (or falling) edge of the
+// given aux pin. Returns false if a parameter is out of range or if the
+// PIO/DMA resources are not available.
+extern bool start(uint32_t sample_rate_hz, uint32_t num_samples, bool trigger,
+                  uint8_t trigger_aux_pin, bool trigger_rising_edge);
+
+// Aborts the current capture, if any.
+extern void stop();
+
+// Returns the current state.
+extern State state();
+
+// Returns the number of samples captured so far.
+extern uint32_t samples_captured();
+
+// The capture buffer. Valid in the kDone state.
+extern const uint8_t* samples();
+
+}  // namespace aux_capture
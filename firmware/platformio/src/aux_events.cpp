@@ -0,0 +1,91 @@
+// Implementation of aux_events.h
+
+#include "aux_events.h"
+
+#include <Arduino.h>
+
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+namespace aux_events {
+
+static constexpr uint32_t kEdgeEvents = GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE;
+
+static uint8_t base_gpio_pin = 0;
+static volatile uint8_t watched_mask = 0;
+
+// A ring buffer of events. Written by the interrupt handler and read
+// by the main loop.
+static Event queue[kQueueSize];
+static volatile uint16_t queue_head = 0;
+static volatile uint16_t queue_size = 0;
+static volatile bool overflow_pending = false;
+
+// Called by the gpio interrupt. NOTE: this replaces the gpio interrupt
+// callback of the core, which is not used otherwise by this firmware.
+static void on_gpio_irq(uint gpio, uint32_t irq_events) {
+  const uint8_t aux_pin = gpio - base_gpio_pin;
+  if (gpio < base_gpio_pin || aux_pin >= 8 ||
+      !(watched_mask & (1 << aux_pin))) {
+    return;
+  }
+  if (queue_size >= kQueueSize) {
+    overflow_pending = true;
+    return;
+  }
+  Event& event = queue[(queue_head + queue_size) % kQueueSize];
+  event.time_us = time_us_32();
+  event.aux_pin = aux_pin;
+  event.edges = ((irq_events & GPIO_IRQ_EDGE_FALL) ? 0b01 : 0) |
+                ((irq_events & GPIO_IRQ_EDGE_RISE) ? 0b10 : 0);
+  event.levels = (uint8_t)(gpio_get_all() >> base_gpio_pin);
+  event.overflow = overflow_pending;
+  overflow_pending = false;
+  queue_size = queue_size + 1;
+}
+
+void setup(uint8_t first_gpio_pin) { base_gpio_pin = first_gpio_pin; }
+
+void subscribe(uint8_t aux_mask) {
+  const uint8_t old_mask = watched_mask;
+
+  const uint32_t saved_irq_status = save_and_disable_interrupts();
+  watched_mask = aux_mask;
+  if (!aux_mask) {
+    queue_size = 0;
+    overflow_pending = false;
+  }
+  restore_interrupts(saved_irq_status);
+
+  for (uint8_t i = 0; i < 8; i++) {
+    const uint8_t pin_mask = 1 << i;
+    if ((aux_mask & pin_mask) == (old_mask & pin_mask)) {
+      continue;
+    }
+    if (aux_mask & pin_mask) {
+      // Ignore changes that happened before the subscription.
+      gpio_acknowledge_irq(base_gpio_pin + i, kEdgeEvents);
+      gpio_set_irq_enabled_with_callback(base_gpio_pin + i, kEdgeEvents, true,
+                                         &on_gpio_irq);
+    } else {
+      gpio_set_irq_enabled(base_gpio_pin + i, kEdgeEvents, false);
+    }
+  }
+}
+
+uint8_t subscribed_mask() { return watched_mask; }
+
+bool pop(Event* event) {
+  const uint32_t saved_irq_status = save_and_disable_interrupts();
+  const bool has_event = queue_size > 0;
+  if (has_event) {
+    *event = queue[queue_head];
+    queue_head = (queue_head + 1) % kQueueSize;
+    queue_size = queue_size - 1;
+  }
+  restore_interrupts(saved_irq_status);
+  return has_event;
+}
+
+}  // namespace aux_events
@@ -0,0 +1,41 @@
+// Aux pins change notifications. Watches selected aux pins with gpio
+// interrupts and queues a timestamped event for each change.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace aux_events {
+
+// A single aux pin change.
+struct Event {
+  // Time of the change, in usecs since startup.
+  uint32_t time_us;
+  uint8_t aux_pin;
+  // Bit 0 is set on a falling edge, bit 1 on a rising edge. Both bits
+  // are set if the pin changed twice before it was handled.
+  uint8_t edges;
+  // The levels of all the aux pins right after the change.
+  uint8_t levels;
+  // True if events were dropped, before this one, due to a full queue.
+  bool overflow;
+};
+
+// Max number of queued events. Additional events are dropped.
+static constexpr uint16_t kQueueSize = 64;
+
+// Called once on startup. The eight aux pins are expected to be consecutive
+// gpio pins, starting with first_gpio_pin.
+extern void setup(uint8_t first_gpio_pin);
+
+// Sets the aux pins to watch. A zero mask stops watching and clears the
+// pending events.
+extern void subscribe(uint8_t aux_mask);
+
+// Returns the mask of the watched aux pins.
+extern uint8_t subscribed_mask();
+
+// Pops the oldest pending event. Returns false if none.
+extern bool pop(Event* event);
+
+}  // namespace aux_events
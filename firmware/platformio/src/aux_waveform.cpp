@@ -0,0 +1,159 @@
+// Implementation of aux_waveform.h
+
+#include "aux_waveform.h"
+
+#include <Arduino.h>
+
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/pio_instructions.h"
+#include "pio_util.h"
+
+namespace aux_waveform {
+
+// The PIO program. The state machine is clocked at 1Mhz, so each
+// instruction takes 1 usec.
+//
+//  .wrap_target
+//    pull block       ; Wait for the next table entry.
+//    out pins, 8      ; Output the aux values.
+//    out x, 24        ; Get the delay count.
+//  delay:
+//    jmp x-- delay    ; Delay (x + 1) usecs.
+//  .wrap
+//
+// Each entry takes (x + 4) usecs so x = duration_us - 4.
+static uint16_t program_instructions[4];
+static const pio_program_t program = {program_instructions, 4, -1};
+
+// The table entries, in the format consumed by the PIO program.
+static uint32_t table[kMaxEntries];
+static uint16_t num_entries = 0;
+
+// Allocated hardware resources.
+static pio_util::PioResources res;
+
+static uint8_t base_gpio_pin = 0;
+
+// The aux pins that are currently controlled by the PIO. Zero if
+// not playing.
+static uint8_t active_mask = 0;
+
+// Returns the current levels of the aux pins.
+static uint8_t read_aux_levels() {
+  return (uint8_t)(gpio_get_all() >> base_gpio_pin);
+}
+
+// Returns the pins to the SIO, driving the given values.
+static void release_pins(uint8_t aux_values) {
+  const uint32_t gpio_mask = ((uint32_t)active_mask) << base_gpio_pin;
+  gpio_put_masked(gpio_mask, ((uint32_t)aux_values) << base_gpio_pin);
+  gpio_set_dir_out_masked(gpio_mask);
+  for (uint i = 0; i < 8; i++) {
+    if (active_mask & (1 << i)) {
+      gpio_set_function(base_gpio_pin + i, GPIO_FUNC_SIO);
+    }
+  }
+  pio_sm_set_enabled(res.pio, res.sm, false);
+  active_mask = 0;
+}
+
+void setup(uint8_t first_gpio_pin) {
+  base_gpio_pin = first_gpio_pin;
+  program_instructions[0] = pio_encode_pull(false, true);
+  program_instructions[1] = pio_encode_out(pio_pins, 8);
+  program_instructions[2] = pio_encode_out(pio_x, 24);
+  program_instructions[3] = pio_encode_jmp_x_dec(3);
+}
+
+void loop() {
+  if (!active_mask) {
+    return;
+  }
+  // The playback is completed when all the entries were consumed and
+  // the state machine stalls, waiting for the next one.
+  const uint32_t stall_bit = 1u << (PIO_FDEBUG_TXSTALL_LSB + res.sm);
+  if (dma_channel_is_busy(res.dma_channel) ||
+      !pio_sm_is_tx_fifo_empty(res.pio, res.sm) ||
+      !(res.pio->fdebug & stall_bit)) {
+    return;
+  }
+  // The PIO outputs the value of the last entry.
+  release_pins(table[num_entries - 1] & 0xff);
+}
+
+void clear() {
+  stop();
+  num_entries = 0;
+}
+
+bool add_entry(uint8_t aux_values, uint32_t duration_us) {
+  if (num_entries >= kMaxEntries || duration_us < kMinDurationUs ||
+      duration_us > kMaxDurationUs) {
+    return false;
+  }
+  table[num_entries++] = ((duration_us - kMinDurationUs) << 8) | aux_values;
+  return true;
+}
+
+bool start(uint8_t aux_mask) {
+  stop();
+  if (!num_entries || !aux_mask || !pio_util::allocate(&program, &res)) {
+    return false;
+  }
+
+  pio_sm_config c = pio_get_default_sm_config();
+  sm_config_set_wrap(&c, res.program_offset,
+                     res.program_offset + program.length - 1);
+  sm_config_set_out_pins(&c, base_gpio_pin, 8);
+  sm_config_set_out_shift(&c, true, false, 32);
+  sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+  sm_config_set_clkdiv(&c, clock_get_hz(clk_sys) / 1000000.0f);
+  pio_sm_init(res.pio, res.sm, res.program_offset, &c);
+
+  // Take over the pins with their current values, to avoid glitches.
+  const uint32_t gpio_mask = ((uint32_t)aux_mask) << base_gpio_pin;
+  pio_sm_set_pins_with_mask(res.pio, res.sm, gpio_get_all(), gpio_mask);
+  pio_sm_set_pindirs_with_mask(res.pio, res.sm, gpio_mask, gpio_mask);
+  for (uint i = 0; i < 8; i++) {
+    if (aux_mask & (1 << i)) {
+      pio_gpio_init(res.pio, base_gpio_pin + i);
+    }
+  }
+  active_mask = aux_mask;
+
+  dma_channel_config dc = dma_channel_get_default_config(res.dma_channel);
+  channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+  channel_config_set_read_increment(&dc, true);
+  channel_config_set_write_increment(&dc, false);
+  channel_config_set_dreq(&dc, pio_get_dreq(res.pio, res.sm, true));
+  dma_channel_configure(res.dma_channel, &dc, &res.pio->txf[res.sm], table,
+                        num_entries, true);
+
+  // Let the DMA fill the FIFO before starting, so the state machine
+  // doesn't stall on the first entries.
+  while (dma_channel_is_busy(res.dma_channel) &&
+         !pio_sm_is_tx_fifo_full(res.pio, res.sm)) {
+  }
+  res.pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + res.sm);
+  pio_sm_set_enabled(res.pio, res.sm, true);
+  return true;
+}
+
+void stop() {
+  if (!active_mask) {
+    return;
+  }
+  dma_channel_abort(res.dma_channel);
+  pio_sm_set_enabled(res.pio, res.sm, false);
+  release_pins(read_aux_levels());
+}
+
+bool is_playing() {
+  loop();
+  return active_mask;
+}
+
+}  // namespace aux_waveform
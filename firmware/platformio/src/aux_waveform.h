@@ -0,0 +1,45 @@
+// Aux pins waveform player. Plays a preloaded table of (aux values, duration)
+// entries using a PIO state machine that is fed by DMA, so the output timing
+// doesn't depend on the CPU or on the USB.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace aux_waveform {
+
+// Max number of entries in a waveform table.
+static constexpr uint16_t kMaxEntries = 256;
+
+// Range of the duration of a single entry, in usecs.
+static constexpr uint32_t kMinDurationUs = 4;
+static constexpr uint32_t kMaxDurationUs = 0xffffff;
+
+// Called once on startup. The eight aux pins are expected to be consecutive
+// gpio pins, starting with first_gpio_pin.
+extern void setup(uint8_t first_gpio_pin);
+
+// Called periodically from the main loop. Returns the pins to regular gpio
+// control once a playback is completed.
+extern void loop();
+
+// Stops the current playback, if any, and clears the table.
+extern void clear();
+
+// Appends an entry to the table. Returns false if the table is full or if
+// the duration is out of range.
+extern bool add_entry(uint8_t aux_values, uint32_t duration_us);
+
+// Starts to play the table on the aux pins that are selected by aux_mask.
+// The selected pins are switched to outputs and, when the playback ends,
+// retain the values of the last entry. Returns false if the table is empty
+// or if the PIO/DMA resources are not available.
+extern bool start(uint8_t aux_mask);
+
+// Stops the current playback, if any. The pins retain their current values.
+extern void stop();
+
+// Returns true if a playback is in progress.
+extern bool is_playing();
+
+}  // namespace aux_waveform
@@ -0,0 +1,96 @@
+// Implementation of init_script.h
+
+#include "init_script.h"
+
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+namespace init_script {
+
+// The script sector is the last sector of the flash.
+static constexpr uint32_t kSectorOffset =
+    PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
+static_assert(FLASH_SECTOR_SIZE == kMaxSize + 8);
+
+// Sector format:
+// - byte 0-3:  Magic "INIT".
+// - byte 4,5:  Script size N, big endian.
+// - byte 6,7:  CRC16 of the script, CCITT, big endian.
+// - byte 8...  The N bytes of the script.
+static constexpr uint8_t kMagic[] = {'I', 'N', 'I', 'T'};
+
+// The sector image of a script that is being stored.
+static uint8_t sector_image[FLASH_SECTOR_SIZE];
+static uint16_t image_size = 0;
+
+static uint16_t crc16(const uint8_t* data, uint16_t n) {
+  uint16_t crc = 0xffff;
+  for (uint16_t i = 0; i < n; i++) {
+    crc ^= ((uint16_t)data[i]) << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+const uint8_t* get(uint16_t* size) {
+  const uint8_t* sector = (const uint8_t*)(XIP_BASE + kSectorOffset);
+  const uint16_t n = (((uint16_t)sector[4]) << 8) | sector[5];
+  const uint16_t crc = (((uint16_t)sector[6]) << 8) | sector[7];
+  if (memcmp(sector, kMagic, sizeof(kMagic)) || n > kMaxSize ||
+      crc16(&sector[8], n) != crc) {
+    return nullptr;
+  }
+  *size = n;
+  return &sector[8];
+}
+
+void begin_store() {
+  memset(sector_image, 0xff, sizeof(sector_image));
+  image_size = 0;
+}
+
+bool append(const uint8_t* data, uint16_t n) {
+  if (n > kMaxSize - image_size) {
+    return false;
+  }
+  memcpy(&sector_image[8 + image_size], data, n);
+  image_size += n;
+  return true;
+}
+
+bool end_store() {
+  const uint16_t crc = crc16(&sector_image[8], image_size);
+  memcpy(sector_image, kMagic, sizeof(kMagic));
+  sector_image[4] = image_size >> 8;
+  sector_image[5] = image_size & 0xff;
+  sector_image[6] = crc >> 8;
+  sector_image[7] = crc & 0xff;
+
+  // The flash is not accessible while it's written, so we run with
+  // interrupts disabled. The SDK's flash functions run from RAM. USB is
+  // not serviced meanwhile, and the USB controller NAKs the host until
+  // we're done. That's typically about 50ms, and up to about 0.5s with
+  // the max sector erase and page program times, which the host driver
+  // allows for.
+  const uint32_t irq_state = save_and_disable_interrupts();
+  flash_range_erase(kSectorOffset, FLASH_SECTOR_SIZE);
+  flash_range_program(kSectorOffset, sector_image, FLASH_SECTOR_SIZE);
+  restore_interrupts(irq_state);
+
+  uint16_t size;
+  const uint8_t* script = get(&size);
+  return script && size == image_size &&
+         !memcmp(script, &sector_image[8], size);
+}
+
+void clear() {
+  const uint32_t irq_state = save_and_disable_interrupts();
+  flash_range_erase(kSectorOffset, FLASH_SECTOR_SIZE);
+  restore_interrupts(irq_state);
+}
+
+}  // namespace init_script
@@ -0,0 +1,30 @@
+// Init script. A command script that is stored in the last sector of the
+// RP2040 flash and is run on startup, so the devices are initialized by
+// the time the host connects. The script is a sequence of commands in the
+// same format as sent by the host, see INIT SCRIPT command in main.cpp.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace init_script {
+
+// Max size of a script, in bytes. One flash sector, less the header.
+static constexpr uint16_t kMaxSize = 4096 - 8;
+
+// Returns the stored script and sets size to its size. Returns null if
+// there is no valid script.
+extern const uint8_t* get(uint16_t* size);
+
+// Storing a script. begin_store() starts a new script, append() adds its
+// bytes, and end_store() writes it to the flash, replacing the current
+// one. append() returns false if the script is too large and end_store()
+// returns false if the verification of the written script failed.
+extern void begin_store();
+extern bool append(const uint8_t* data, uint16_t n);
+extern bool end_store();
+
+// Erases the stored script, if any.
+extern void clear();
+
+}  // namespace init_script
@@ -3,10 +3,18 @@
 #include <Arduino.h>
 #include <SPI.h>
 
+#include "aux_capture.h"
+#include "aux_events.h"
+#include "aux_waveform.h"
 #include "board.h"
-
-// #pragma GCC push_options
-// #pragma GCC optimize("Og")
+#include "init_script.h"
+#include "qspi.h"
+#include "spi_hw.h"
+#include "stats.h"
+#include "time_critical.h"
+#include "timing.h"
+#include "trace.h"
+#include "transport.h"
 
 using board::led;
 
@@ -54,12 +62,25 @@ static constexpr uint16_t kMaxTransactionBytes = 256;
 // All command bytes must arrive within this time period.
 static constexpr uint32_t kCommandTimeoutMillis = 250;
 
+// A CS that is held asserted by a SEND command is released if no
+// other SEND command arrives within this time period.
+static constexpr uint32_t kCsHoldTimeoutMillis = 500;
+
+// Max value of the CS timing parameters. Since they are enforced with
+// busy waits, we keep them short.
+static constexpr uint32_t kMaxCsTimingNs = 10000000;
+
 // Since LED updates may involved neopixel communication, we minimize
 // it by filtering the 'no-change' updates.
 static bool last_led_state;
 
+// Max number of bytes of a daisy chain transaction.
+static constexpr uint16_t kMaxChainBytes = 4096;
+
 // A temporary buffer for commands and SPI operations.
 static uint8_t data_buffer[kMaxTransactionBytes];
+// TX/RX buffer of daisy chain transactions.
+static uint8_t chain_buffer[kMaxChainBytes];
 // The number of valid bytes in data_buffer.
 static uint16_t data_size = 0;
 
@@ -68,7 +89,7 @@ static uint16_t data_size = 0;
 // level. See https://github.com/arduino/ArduinoCore-mbed/issues/828
 static SPIMode last_spi_mode = SPI_MODE1;
 
-static void track_spi_clock_polarity(SPIMode new_spi_mode) {
+static void TIME_CRITICAL(track_spi_clock_polarity)(SPIMode new_spi_mode) {
   // No change.
   if (new_spi_mode == last_spi_mode) {
     return;
@@ -99,40 +120,212 @@ class Timer {
   uint32_t _start_millis;
 };
 
+// Per CS timing requirements, in nsecs. Set by the CS TIMING command.
+struct CsTiming {
+  // Min time from CS assertion to the first SCK edge.
+  uint32_t setup_ns = 0;
+  // Min time from the last SCK edge to CS release.
+  uint32_t hold_ns = 0;
+  // Min time from CS release to the next CS assertion.
+  uint32_t gap_ns = 0;
+};
+static CsTiming cs_timings[kNumCsPins];
+
+// The CS outputs that are currently on, one bit per CS index.
+static uint8_t active_cs_mask = 0;
+// The micros() time at which each CS output was last turned off.
+static uint32_t cs_off_micros[kNumCsPins];
+
 // Turn off all CS outputs.
-static inline void all_cs_off() {
+static inline void TIME_CRITICAL(all_cs_off)() {
   static_assert(kNumCsPins == 4);
+  // Apply the hold time of the active CS outputs, if any.
+  if (active_cs_mask) {
+    uint32_t hold_ns = 0;
+    for (uint8_t i = 0; i < kNumCsPins; i++) {
+      if (active_cs_mask & (1 << i)) {
+        hold_ns = std::max(hold_ns, cs_timings[i].hold_ns);
+      }
+    }
+    timing::busy_wait_ns(hold_ns);
+  }
   digitalWrite(cs_pins[0], HIGH);
   digitalWrite(cs_pins[1], HIGH);
   digitalWrite(cs_pins[2], HIGH);
   digitalWrite(cs_pins[3], HIGH);
+  if (active_cs_mask) {
+    const uint32_t micros_now = micros();
+    for (uint8_t i = 0; i < kNumCsPins; i++) {
+      if (active_cs_mask & (1 << i)) {
+        cs_off_micros[i] = micros_now;
+      }
+    }
+    active_cs_mask = 0;
+  }
+}
+
+// Turn on a set of CS outputs, one bit per CS index.
+static inline void TIME_CRITICAL(cs_mask_on)(uint8_t cs_mask) {
+  // Complete the min gap since the CS outputs were turned off. Since
+  // micros() has a 1 usec resolution, we may wait up to 1 usec longer
+  // than needed.
+  const uint32_t micros_now = micros();
+  uint32_t gap_ns = 0;
+  uint32_t setup_ns = 0;
+  for (uint8_t i = 0; i < kNumCsPins; i++) {
+    const uint8_t bit = 1 << i;
+    if (!(cs_mask & bit)) {
+      continue;
+    }
+    const CsTiming& cs_timing = cs_timings[i];
+    setup_ns = std::max(setup_ns, cs_timing.setup_ns);
+    if (cs_timing.gap_ns && !(active_cs_mask & bit)) {
+      const uint32_t elapsed_us = micros_now - cs_off_micros[i];
+      // The first condition also prevents an overflow of elapsed_ns.
+      const uint32_t elapsed_ns = elapsed_us * 1000;
+      if (elapsed_us <= kMaxCsTimingNs / 1000 &&
+          elapsed_ns < cs_timing.gap_ns) {
+        gap_ns = std::max(gap_ns, cs_timing.gap_ns - elapsed_ns);
+      }
+    }
+  }
+  timing::busy_wait_ns(gap_ns);
+  for (uint8_t i = 0; i < kNumCsPins; i++) {
+    if (cs_mask & (1 << i)) {
+      digitalWrite(cs_pins[i], LOW);
+    }
+  }
+  active_cs_mask |= cs_mask;
+  timing::busy_wait_ns(setup_ns);
 }
 
 // Turn on a specific CS output.
 static inline void cs_on(uint8_t cs_index) {
   if (cs_index < kNumCsPins) {
-    digitalWrite(cs_pins[cs_index], LOW);
+    cs_mask_on(1 << cs_index);
   }
 }
 
 // Time since the start of last cmd.
 static Timer cmd_timer;
 
+// Restarts the command timeout. Used by long commands that stream data
+// or wait for a device, to indicate progress.
+static void extend_cmd_timeout() { cmd_timer.reset(millis()); }
+
+// Stats and trace info of the current command.
+static trace::Entry cmd_trace;
+static uint32_t cmd_receive_end_us = 0;
+static uint32_t cmd_bytes_written_start = 0;
+
+// Start time of the current SPI transaction.
+static uint32_t spi_start_us = 0;
+
+// True if CS outputs are held asserted by the last SEND command. Their
+// mask is in held_cs_mask. While held, only the transport channel that
+// held them is served, so its device transaction is not interrupted.
+static bool is_cs_held = false;
+static uint8_t held_cs_mask = 0;
+static uint8_t held_cs_channel = 0;
+// Time since the CS was held.
+static Timer cs_hold_timer;
+
+// Release the held CS output, if any.
+static void release_held_cs() {
+  if (is_cs_held) {
+    all_cs_off();
+    is_cs_held = false;
+  }
+}
+
+// Start an SPI transaction with a set of CS outputs, one bit per CS index.
+// speed_units are in 25Khz steps.
+static void TIME_CRITICAL(begin_spi_transaction)(uint8_t cs_mask,
+                                                 SPIMode spi_mode,
+                                                 uint8_t speed_units) {
+  // A held CS of other devices can't be part of this transaction. Release
+  // it first, so the held devices don't see the clock level change below.
+  if (is_cs_held && held_cs_mask != cs_mask) {
+    release_held_cs();
+  }
+
+  // If changing mode, update the clock idle clock level.
+  track_spi_clock_polarity(spi_mode);
+
+  const uint32_t frequency_hz = ((uint32_t)speed_units) * 25000;
+  SPISettings spi_setting(frequency_hz, MSBFIRST, spi_mode);
+  spi_start_us = stats::now_us();
+  cmd_trace.cs_mask = cs_mask;
+  cmd_trace.spi_mode = spi_mode;
+  cmd_trace.speed_units = speed_units;
+  cs_mask_on(cs_mask);
+  SPI.beginTransaction(spi_setting);
+}
+
+// End an SPI transaction. If hold_cs is true, the CS outputs are kept
+// asserted for the next transaction, see kCsHoldTimeoutMillis.
+static void TIME_CRITICAL(end_spi_transaction)(bool hold_cs = false) {
+  SPI.endTransaction();
+  if (hold_cs) {
+    is_cs_held = true;
+    held_cs_mask = active_cs_mask;
+    held_cs_channel = transport::selected_channel();
+    cs_hold_timer.reset(millis());
+  } else {
+    is_cs_held = false;
+    all_cs_off();
+  }
+  stats::add_phase(stats::kSpi, stats::now_us() - spi_start_us);
+}
+
 // Fill data_buffer with n bytes. Done in chunks. data_size tracks the
 // num of bytes read so far.
-static bool read_serial_bytes(uint16_t n) {
+static bool TIME_CRITICAL(read_serial_bytes)(uint16_t n) {
+  // Already have them. Happens when a header is read in stages, e.g. a
+  // first byte that determines the header size, and a previous loop
+  // already got a part of the later stage.
+  if (data_size >= n) {
+    return true;
+  }
+
   // Handle the case where not enough chars.
-  const uint16_t avail = Serial.available();
+  const uint16_t avail = transport::available();
   const uint16_t required = n - data_size;
   const uint16_t requested = std::min(avail, required);
 
   if (requested) {
     size_t actual_read =
-        Serial.readBytes((char*)(&data_buffer[data_size]), requested);
+        transport::read(&data_buffer[data_size], requested);
     data_size += actual_read;
+    cmd_trace.bytes_in += actual_read;
+  }
+
+  const bool is_done = data_size >= n;
+  if (is_done) {
+    cmd_receive_end_us = stats::now_us();
   }
+  return is_done;
+}
+
+// Returns a big endian uint32 from the given 4 bytes.
+static uint32_t read_uint32(const uint8_t* bfr) {
+  return (((uint32_t)bfr[0]) << 24) + (((uint32_t)bfr[1]) << 16) +
+         (((uint32_t)bfr[2]) << 8) + bfr[3];
+}
+
+// Sends an error response with the given error code.
+static void send_error_response(uint8_t error_code) {
+  cmd_trace.status = error_code;
+  transport::write('E');
+  transport::write(error_code);
+}
 
-  return data_size >= n;
+// Writes a big endian uint32 to the serial port.
+static void write_uint32(uint32_t value) {
+  transport::write(value >> 24);
+  transport::write((value >> 16) & 0xff);
+  transport::write((value >> 8) & 0xff);
+  transport::write(value & 0xff);
 }
 
 // Abstract base of all command handlers.
@@ -169,7 +362,7 @@ static class EchoCommandHandler : public CommandHandler {
     if (!read_serial_bytes(1)) {
       return false;
     }
-    Serial.write(data_buffer[0]);
+    transport::write(data_buffer[0]);
     return true;
   }
 } echo_cmd_handler;
@@ -193,18 +386,77 @@ static class InfoCommandHandler : public CommandHandler {
  public:
   InfoCommandHandler() : CommandHandler("INFO") {}
   virtual bool on_cmd_loop() override {
-    Serial.write('K');  // 'K' for OK.
-    Serial.write('S');
-    Serial.write('P');
-    Serial.write('I');
-    Serial.write(0x03);                     // Number of bytes to follow.
-    Serial.write(kApiVersion);              // API version.
-    Serial.write(kFirmwareVersion >> 8);    // Firmware version MSB.
-    Serial.write(kFirmwareVersion & 0x08);  // Firmware version LSB.
+    transport::write('K');  // 'K' for OK.
+    transport::write('S');
+    transport::write('P');
+    transport::write('I');
+    transport::write(0x03);                     // Number of bytes to follow.
+    transport::write(kApiVersion);              // API version.
+    transport::write(kFirmwareVersion >> 8);    // Firmware version MSB.
+    transport::write(kFirmwareVersion & 0xff);  // Firmware version LSB.
     return true;
   }
 } info_cmd_handler;
 
+// EXTENDED INFO command. Provides the capabilities and limits of this
+// firmware, so the host can use the features it supports. The commands
+// themselves are discovered with the commands bitmap of the HELLO
+// command, rather than with the features bitmap.
+//
+// Command:
+// - byte 0:      'g'
+//
+// Response:
+// - byte 0:      'K' for OK.
+// - byte 1:      Number of bytes to follow (20). Fields may be added at
+//                the end, so hosts should skip the ones they don't know.
+// - byte 2:      Version of wire format API.
+// - byte 3,4:    Firmware version. Big endian.
+// - byte 5-8:    Features bitmap, see below. Big endian.
+// - byte 9,10:   Max bytes per SEND transaction. Big endian.
+// - byte 11-14:  Min SPI speed in Hz. Big endian.
+// - byte 15-18:  Max SPI speed in Hz. Big endian.
+// - byte 19:     Number of CS outputs.
+// - byte 20:     Number of aux pins.
+// - byte 21:     Number of transport channels, see transport.h.
+
+// Features bitmap bits
+// 0    : SEND can hold the CS asserted for the next SEND.
+// 1    : SEND can broadcast to several CS outputs.
+// 2    : SEND supports words of 4 to 16 and 32 bits.
+// 3    : Commands can be pipelined. The host may send commands before
+//        reading the responses of the previous ones. They are processed
+//        in order, and the USB flow control holds the ones that are not
+//        read yet. The firmware doesn't buffer the responses, so the
+//        host should bound the unread response bytes by the buffers of
+//        its serial port, or the firmware blocks on sending them.
+// 4-31 : Reserved. Always 0.
+static class ExtendedInfoCommandHandler : public CommandHandler {
+ public:
+  ExtendedInfoCommandHandler() : CommandHandler("EXTENDED INFO") {}
+  virtual bool on_cmd_loop() override {
+    transport::write('K');
+    transport::write(20);  // Number of bytes to follow.
+    transport::write(kApiVersion);
+    transport::write(kFirmwareVersion >> 8);
+    transport::write(kFirmwareVersion & 0xff);
+    write_uint32(kFeatures);
+    transport::write(kMaxTransactionBytes >> 8);
+    transport::write(kMaxTransactionBytes & 0xff);
+    write_uint32(kMinSpeedUnits * 25000);
+    write_uint32(kMaxSpeedUnits * 25000);
+    transport::write(kNumCsPins);
+    transport::write(kNumAuxPins);
+    transport::write(transport::kNumChannels);
+    return true;
+  }
+
+ private:
+  static constexpr uint32_t kFeatures = 0b1111;
+  static constexpr uint32_t kMinSpeedUnits = 1;
+  static constexpr uint32_t kMaxSpeedUnits = 160;
+} extended_info_cmd_handler;
+
 // SEND command. Send bytes to a device and read the returned bytes.
 //
 // Command:
@@ -215,7 +467,11 @@ static class InfoCommandHandler : public CommandHandler {
 //              the range 0 to (kMaxTransactionBytes - extra_bytes_to_write).
 // - byte 5,6:  Number of extra 0x00 bytes to write. Big endian. should
 //              range 0 to kMaxTransactionBytes.
-// - Byte 7...  The custom data bytes to write.
+// - byte 7:    CS mask. Included only if config.b6 is set, see below.
+// - byte 7/8:  Word format byte. Included only if config.b7 is set, see
+//              below. Follows the CS mask byte, if included.
+// - Byte 7...  The custom data bytes to write. Start after the CS mask
+//              and word format bytes, if included.
 //
 // Error response:
 // - byte 0:    'E' for error.
@@ -233,8 +489,26 @@ static class InfoCommandHandler : public CommandHandler {
 // 0,1 : CS index.
 // 2:3 : SPI mode, per arduino::SPIMode.
 // 4   : Include bytes read in response
-// 5   : Reserved. Should be 0.
-// 6   : Reserved. Should be 0.
+// 5   : Hold CS. Keep the CS asserted after the transaction, for a
+//       following SEND command with the same CS. The CS is released by
+//       the first SEND without this bit, by a SEND with different CS
+//       outputs, or if no SEND arrives within kCsHoldTimeoutMillis.
+// 6   : Broadcast. The CS outputs are selected by the CS mask byte, one
+//       bit per CS index, rather than by bits 0,1. Allows to write the
+//       same data to several identical devices at once. Should be
+//       used with bit 4 cleared since the devices' MISO outputs would
+//       conflict.
+// 7   : Word format. The word format byte is included, see below.
+//       Otherwise the data is sent as 8 bit words.
+
+// Word format byte bits. The byte counts in the header are of data bytes
+// and should be a multiple of the bytes per word.
+// 0-5 : Word size in bits. Valid values are 4 to 16, with 1 byte per
+//       word for up to 8 bits and 2 bytes per word otherwise, and 32 with
+//       4 bytes per word.
+// 6   : Little endian. The bytes of each word are in little endian order
+//       rather than big endian. Applies to both the written and the
+//       returned bytes.
 // 7   : Reserved. Should be 0.
 
 // Error code:
@@ -248,6 +522,10 @@ static class InfoCommandHandler : public CommandHandler {
 // 10 : Extra byte count is out of range.
 // 11 : Byte count out of limit
 // 12 : Speed byte is out of range.
+// 13 : CS mask is out of range.
+// 14 : Broadcast with read bytes in response.
+// 15 : Word format byte is out of range.
+// 16 : Byte count is not a multiple of the bytes per word.
 //
 static class SendCommandHandler : public CommandHandler {
  public:
@@ -255,17 +533,28 @@ static class SendCommandHandler : public CommandHandler {
 
   virtual void on_cmd_entered() override { reset(); }
 
-  virtual bool on_cmd_loop() override {
+  virtual bool TIME_CRITICAL(on_cmd_loop)() override {
     // Read command header.
     if (!_got_cmd_header) {
-      static_assert(sizeof(data_buffer) >= 6);
-      if (!read_serial_bytes(6)) {
+      // The config byte determines the header size.
+      static_assert(sizeof(data_buffer) >= 8);
+      if (!read_serial_bytes(1)) {
+        return false;
+      }
+      const bool broadcast = data_buffer[0] & 0b1000000;
+      const bool has_word_format = data_buffer[0] & 0b10000000;
+      if (!read_serial_bytes(6 + broadcast + has_word_format)) {
         return false;
       }
       // Parse the command header
-      _cs_index = data_buffer[0] & 0b11;
+      _cs_mask = broadcast ? data_buffer[6] : 1 << (data_buffer[0] & 0b11);
+      const uint8_t word_format =
+          has_word_format ? data_buffer[6 + broadcast] : 8;
+      _word_bits = word_format & 0b111111;
+      _little_endian = word_format & 0b1000000;
       _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
       _return_read_bytes = data_buffer[0] & 0b10000;
+      _hold_cs = data_buffer[0] & 0b100000;
       _speed_units = data_buffer[1];
       _custom_data_count = (((uint16_t)data_buffer[2]) << 8) + data_buffer[3];
       _extra_data_count = (((uint16_t)data_buffer[4]) << 8) + data_buffer[5];
@@ -279,10 +568,16 @@ static class SendCommandHandler : public CommandHandler {
           : (_extra_data_count > kMaxTransactionBytes)  ? 0x0a
           : (_custom_data_count + _extra_data_count > kMaxTransactionBytes)
               ? 0x0b
+          : (!_cs_mask || _cs_mask >> kNumCsPins) ? 0x0d
+          : (broadcast && _return_read_bytes)     ? 0x0e
+          : (!spi_hw::word_bytes(_word_bits) || (word_format & 0b10000000))
+              ? 0x0f
+          : ((_custom_data_count % spi_hw::word_bytes(_word_bits)) ||
+             (_extra_data_count % spi_hw::word_bytes(_word_bits)))
+              ? 0x10
               : 0x00;
       if (error_code) {
-        Serial.write('E');
-        Serial.write(error_code);
+        send_error_response(error_code);
         return true;
       }
     }
@@ -300,30 +595,27 @@ static class SendCommandHandler : public CommandHandler {
     static_assert(sizeof(data_buffer) >= kMaxTransactionBytes);
     memset(&data_buffer[_custom_data_count], 0, _extra_data_count);
 
-    // If changing mode, update the clock idle clock level.
-    track_spi_clock_polarity(_spi_mode);
-
     // Perform the SPI transaction using data_buffer as TX/RX buffer.
-    const uint32_t frequency_hz = ((uint32_t)_speed_units) * 25000;
-    SPISettings spi_setting(frequency_hz, MSBFIRST, _spi_mode);
-
-    cs_on(_cs_index);
-    SPI.beginTransaction(spi_setting);
-
-    // Perofrm the transaction, using data_buffer and both TX and RX buffer.
+    begin_spi_transaction(_cs_mask, _spi_mode, _speed_units);
     const uint16_t total_bytes = _custom_data_count + _extra_data_count;
-    SPI.transfer(data_buffer, total_bytes);
-
-    SPI.endTransaction();
-    all_cs_off();
+    if (_word_bits == 8) {
+      SPI.transfer(data_buffer, total_bytes);
+    } else {
+      // Words of up to 8 bits take a frame per byte, the others take a
+      // frame per two bytes.
+      static_assert(spi_hw::kMaxFrames >= kMaxTransactionBytes);
+      spi_hw::transfer_words(_word_bits, _little_endian, _spi_mode,
+                             data_buffer, total_bytes);
+    }
+    end_spi_transaction(_hold_cs);
 
     // All done. Send OK response.
-    Serial.write('K');
+    transport::write('K');
     const uint16_t response_count = _return_read_bytes ? total_bytes : 0;
-    Serial.write(response_count >> 8);    // Count MSB
-    Serial.write(response_count & 0xff);  // Count LSB
+    transport::write(response_count >> 8);    // Count MSB
+    transport::write(response_count & 0xff);  // Count LSB
     if (response_count) {
-      Serial.write(data_buffer, response_count);
+      transport::write(data_buffer, response_count);
     }
     return true;
   }
@@ -332,21 +624,27 @@ static class SendCommandHandler : public CommandHandler {
   bool _got_cmd_header = false;
 
   // Command header info.
-  uint8_t _cs_index;
+  uint8_t _cs_mask;
   SPIMode _spi_mode;
   bool _return_read_bytes;
+  bool _hold_cs;
   uint8_t _speed_units;
   uint16_t _custom_data_count;
   uint16_t _extra_data_count;
+  uint8_t _word_bits;
+  bool _little_endian;
 
   void reset() {
     _got_cmd_header = false;
-    _cs_index = 0;
+    _cs_mask = 0;
     _spi_mode = SPI_MODE0;
     _return_read_bytes = false;
+    _hold_cs = false;
     _speed_units = 0;
     _custom_data_count = 0;
     _extra_data_count = 0;
+    _word_bits = 8;
+    _little_endian = false;
   }
 
 } send_cmd_handler;
@@ -385,8 +683,7 @@ static class AuxPinModeCommandHandler : public CommandHandler {
 
     // Check aux pin index range.
     if (aux_pin_index >= kNumAuxPins) {
-      Serial.write('E');
-      Serial.write(0x01);
+      send_error_response(0x01);
       return true;
     }
 
@@ -411,13 +708,12 @@ static class AuxPinModeCommandHandler : public CommandHandler {
         break;
 
       default:
-        Serial.write('E');
-        Serial.write(0x02);
+        send_error_response(0x02);
         return true;
     }
 
     // All done Ok
-    Serial.write('K');
+    transport::write('K');
     return true;
   }
 
@@ -452,8 +748,8 @@ static class AuxPinsReadCommandHandler : public CommandHandler {
     }
 
     // All done Ok
-    Serial.write('K');
-    Serial.write(result);
+    transport::write('K');
+    transport::write(result);
     return true;
   }
 
@@ -493,100 +789,2244 @@ static class AuxPinsWriteCommandHandler : public CommandHandler {
     }
 
     // All done Ok
-    Serial.write('K');
+    transport::write('K');
     return true;
   }
 
 } aux_pins_write_cmd_handler;
 
-// Given a command char, return a Command pointer or null if invalid command
-// char.
-static CommandHandler* find_command_handler_by_char(const char cmd_char) {
-  switch (cmd_char) {
-    case 'e':
-      return &echo_cmd_handler;
-    case 'i':
-      return &info_cmd_handler;
-    case 'm':
-      return &aux_mode_cmd_handler;
-    case 'a':
-      return &aux_pins_read_cmd_handler;
-    case 'b':
-      return &aux_pins_write_cmd_handler;
-    case 's':
-      return &send_cmd_handler;
-    default:
-      return nullptr;
-  }
-}
+// AUXILARY PINS WAVEFORM command. Plays a table of aux pins values with
+// deterministic timing, independently of the USB communication.
+//
+// Command:
+// - byte 0:    'w'
+// - byte 1:    Operation, per the list below.
+//
+// Operation 1, load and start:
+// - byte 2:    Mask of the aux pins to drive. Non zero.
+// - byte 3,4:  Number of table entries N. Big endian. In the range 1 to
+//              aux_waveform::kMaxEntries.
+// - Byte 5...  N table entries, each has 4 bytes:
+//              - byte 0:    Aux pins values.
+//              - byte 1-3:  Duration in usecs. Big endian. In the range
+//                           aux_waveform::kMinDurationUs to kMaxDurationUs.
+//
+// Operation 2, status:
+//    No additional bytes.
+//
+// Operation 3, stop:
+//    No additional bytes.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1:    For the status operation only, 1 if playing, 0 otherwise.
+//
+// The pins that are selected by the mask are switched to outputs and
+// retain the values of the last entry once the playback ends. Aux pins
+// commands should not be used on these pins while the waveform is
+// playing. Starting a new waveform stops the current one, if any.
 
-void setup() {
-  // A short delay to let the USB/CDC settle down. Otherwise
-  // it messes up with the debugger, in case it's used.
-  delay(500);
+// Error codes:
+//  1 : Operation value out of range.
+//  2 : Aux pins mask is zero.
+//  3 : Number of entries out of range.
+//  4 : Duration out of range.
+//  5 : Hardware resources not available.
+static class AuxWaveformCommandHandler : public CommandHandler {
+ public:
+  AuxWaveformCommandHandler() : CommandHandler("AUX_WAVEFORM") { reset(); }
 
-  board::setup();
-  board::led.update(false);
-  last_led_state = false;
+  virtual void on_cmd_entered() override { reset(); }
 
-  // USB serial.
-  Serial.begin(115200);
+  virtual bool on_cmd_loop() override {
+    if (!_got_cmd_header) {
+      // Read the operation.
+      static_assert(sizeof(data_buffer) >= 1);
+      if (!read_serial_bytes(1)) {
+        return false;
+      }
+      switch (data_buffer[0]) {
+        case 1:
+          break;
+
+        case 2:
+          transport::write('K');
+          transport::write(aux_waveform::is_playing() ? 1 : 0);
+          return true;
+
+        case 3:
+          aux_waveform::stop();
+          transport::write('K');
+          return true;
+
+        default:
+          send_error_response(0x01);
+          return true;
+      }
 
-  // Init CS outputs.
-  for (uint8_t i = 0; i < kNumCsPins; i++) {
-    auto gp_pin = cs_pins[i];
-    pinMode(gp_pin, OUTPUT);
+      // Read the rest of the start operation header.
+      static_assert(sizeof(data_buffer) >= 4);
+      if (!read_serial_bytes(4)) {
+        return false;
+      }
+      _aux_mask = data_buffer[1];
+      _num_entries = (((uint16_t)data_buffer[2]) << 8) + data_buffer[3];
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (!_aux_mask) ? 0x02
+          : (_num_entries < 1 || _num_entries > aux_waveform::kMaxEntries)
+              ? 0x03
+              : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+      aux_waveform::clear();
+    }
+
+    // Read the entries, one at a time.
+    static_assert(sizeof(data_buffer) >= 4);
+    while (_entries_read < _num_entries) {
+      if (!read_serial_bytes(4)) {
+        return false;
+      }
+      const uint32_t duration_us = (((uint32_t)data_buffer[1]) << 16) +
+                                   (((uint32_t)data_buffer[2]) << 8) +
+                                   data_buffer[3];
+      if (!aux_waveform::add_entry(data_buffer[0], duration_us)) {
+        _bad_duration = true;
+      }
+      data_size = 0;
+      _entries_read++;
+    }
+
+    if (_bad_duration) {
+      aux_waveform::clear();
+      send_error_response(0x04);
+      return true;
+    }
+
+    if (!aux_waveform::start(_aux_mask)) {
+      send_error_response(0x05);
+      return true;
+    }
+
+    // All done Ok
+    transport::write('K');
+    return true;
   }
-  all_cs_off();
 
-  // Init aux pins as inputs.
-  for (uint8_t i = 0; i < kNumAuxPins; i++) {
-    auto gp_pin = aux_pins[i];
-    pinMode(gp_pin, INPUT_PULLUP);
+ private:
+  bool _got_cmd_header = false;
+  uint8_t _aux_mask;
+  uint16_t _num_entries;
+  uint16_t _entries_read;
+  bool _bad_duration;
+
+  void reset() {
+    _got_cmd_header = false;
+    _aux_mask = 0;
+    _num_entries = 0;
+    _entries_read = 0;
+    _bad_duration = false;
   }
 
-  // Initialize the SPI channel.
-  SPI.begin();
-  track_spi_clock_polarity(SPI_MODE0);
-}
+} aux_waveform_cmd_handler;
 
-// If in command, points to the command handler.
-static CommandHandler* current_cmd = nullptr;
+// AUXILARY PINS CAPTURE command. Samples the aux pins at a fixed rate,
+// similar to a logic analyzer.
+//
+// Command:
+// - byte 0:    'c'
+// - byte 1:    Operation, per the list below.
+//
+// Operation 1, start:
+// - byte 2-5:  Sample rate in Hz. Big endian. In the range
+//              aux_capture::kMinSampleRateHz to kMaxSampleRateHz.
+// - byte 6-9:  Number of samples. Big endian. A multiple of 4 in the
+//              range 4 to aux_capture::kMaxSamples.
+// - byte 10:   Trigger config byte, see below.
+//
+// Operation 2, status:
+//    No additional bytes.
+//
+// Operation 3, read samples:
+//    No additional bytes.
+//
+// Operation 4, stop:
+//    No additional bytes.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response, start and stop operations:
+// - byte 0:    'K' for 'OK'.
+//
+// OK response, status operation:
+// - byte 0:    'K' for 'OK'.
+// - byte 1:    Capture state, per aux_capture::State.
+// - byte 2-5:  Number of samples captured so far. Big endian.
+//
+// OK response, read samples operation:
+// - byte 0:    'K' for 'OK'.
+// - byte 1-4:  Number of samples N. Big endian.
+// - byte 5...  N samples, one byte each, with aux pin 0 at bit 0.
 
-void loop() {
-  Serial.flush();
-  const uint32_t millis_now = millis();
-  const uint32_t millis_since_cmd_start = cmd_timer.elapsed_millis(millis_now);
+// Trigger config byte bits
+// 0:2 : Trigger aux pin index.
+// 3   : Reserved. Should be 0.
+// 4   : Reserved. Should be 0.
+// 5   : Reserved. Should be 0.
+// 6   : Trigger on rising edge if 1, on falling edge if 0.
+// 7   : Trigger enabled if 1, start immediately if 0.
 
-  // Update LED state. Solid if active or short blinks if idle.
-  {
-    const bool is_active = current_cmd || millis_since_cmd_start < 200;
-    const bool new_led_state =
-        is_active || (millis_since_cmd_start & 0b11111111100) == 0;
-    if (new_led_state != last_led_state) {
-      led.update(new_led_state);
-      last_led_state = new_led_state;
+// Error codes:
+//  1 : Operation value out of range.
+//  2 : Sample rate out of range.
+//  3 : Number of samples out of range.
+//  4 : Hardware resources not available.
+//  5 : Capture is not completed.
+static class AuxCaptureCommandHandler : public CommandHandler {
+ public:
+  AuxCaptureCommandHandler() : CommandHandler("AUX_CAPTURE") {}
+
+  virtual bool on_cmd_loop() override {
+    // Read the operation.
+    static_assert(sizeof(data_buffer) >= 1);
+    if (!read_serial_bytes(1)) {
+      return false;
+    }
+    switch (data_buffer[0]) {
+      case 1:
+        return start_op();
+
+      case 2: {
+        const aux_capture::State state = aux_capture::state();
+        const uint32_t samples_captured = aux_capture::samples_captured();
+        transport::write('K');
+        transport::write(state);
+        write_uint32(samples_captured);
+        return true;
+      }
+
+      case 3: {
+        if (aux_capture::state() != aux_capture::kDone) {
+          send_error_response(0x05);
+          return true;
+        }
+        const uint32_t samples_captured = aux_capture::samples_captured();
+        transport::write('K');
+        write_uint32(samples_captured);
+        transport::write(aux_capture::samples(), samples_captured);
+        return true;
+      }
+
+      case 4:
+        aux_capture::stop();
+        transport::write('K');
+        return true;
+
+      default:
+        send_error_response(0x01);
+        return true;
     }
   }
 
-  // If a command is in progress, handle it.
-  if (current_cmd) {
-    // Handle command timeout.
-    if (millis_since_cmd_start > kCommandTimeoutMillis) {
-      current_cmd->on_cmd_aborted();
-      current_cmd = nullptr;
-      return;
+ private:
+  bool start_op() {
+    static_assert(sizeof(data_buffer) >= 10);
+    if (!read_serial_bytes(10)) {
+      return false;
     }
-    // Invoke command loop.
-    const bool cmd_completed = current_cmd->on_cmd_loop();
-    if (cmd_completed) {
-      current_cmd = nullptr;
+    const uint32_t sample_rate_hz = read_uint32(&data_buffer[1]);
+    const uint32_t num_samples = read_uint32(&data_buffer[5]);
+    const uint8_t trigger_config = data_buffer[9];
+
+    // Validate the command.
+    const uint8_t error_code =
+        (sample_rate_hz < aux_capture::kMinSampleRateHz ||
+         sample_rate_hz > aux_capture::kMaxSampleRateHz)
+            ? 0x02
+        : (num_samples < 4 || num_samples > aux_capture::kMaxSamples ||
+           num_samples % 4)
+            ? 0x03
+            : 0x00;
+    if (error_code) {
+      send_error_response(error_code);
+      return true;
     }
-    return;
+
+    const bool trigger = trigger_config & 0b10000000;
+    const bool trigger_rising_edge = trigger_config & 0b01000000;
+    const uint8_t trigger_aux_pin = trigger_config & 0b111;
+    if (!aux_capture::start(sample_rate_hz, num_samples, trigger,
+                            trigger_aux_pin, trigger_rising_edge)) {
+      send_error_response(0x04);
+      return true;
+    }
+
+    // All done Ok
+    transport::write('K');
+    return true;
   }
 
-  // Not in a command. Turn off all CS outputs. Just in case.
-  all_cs_off();
+} aux_capture_cmd_handler;
+
+// The transport channel of the last AUX NOTIFY command, which receives
+// the events.
+static uint8_t aux_events_channel = 0;
+
+// AUXILARY PINS NOTIFICATIONS command. Selects the aux pins to watch for
+// changes. Each change of a watched pin is reported to the host with an
+// unsolicited event message that is sent between command responses.
+//
+// Command:
+// - byte 0:    'n'
+// - byte 1:    Mask of aux pins to watch. Zero to stop watching.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Reserved. Always 0.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+//
+// Event message:
+// - byte 0:    '!'
+// - byte 1:    Aux pin index.
+// - byte 2:    Event flags, see below.
+// - byte 3:    Aux pins values right after the change.
+// - byte 4-7:  Time of the change in usecs since startup. Big endian.
+
+// Event flags bits
+// 0   : Falling edge.
+// 1   : Rising edge.
+// 2:6 : Reserved. Always 0.
+// 7   : Previous events were lost due to a full event queue.
+static class AuxNotifyCommandHandler : public CommandHandler {
+ public:
+  AuxNotifyCommandHandler() : CommandHandler("AUX_NOTIFY") {}
+
+  virtual bool on_cmd_loop() override {
+    static_assert(sizeof(data_buffer) >= 1);
+    if (!read_serial_bytes(1)) {
+      return false;
+    }
+    aux_events::subscribe(data_buffer[0]);
+    aux_events_channel = transport::selected_channel();
+
+    // All done Ok
+    transport::write('K');
+    return true;
+  }
+
+} aux_notify_cmd_handler;
+
+// Sends the pending aux pin change events to the host, on the channel
+// that subscribed to them.
+static void send_aux_events() {
+  aux_events::Event event;
+  while (aux_events::pop(&event)) {
+    transport::select_channel(aux_events_channel);
+    transport::write('!');
+    transport::write(event.aux_pin);
+    transport::write(event.edges | (event.overflow ? 0b10000000 : 0));
+    transport::write(event.levels);
+    write_uint32(event.time_us);
+  }
+}
+
+// SET CS TIMING command. Sets the timing requirements of the device at a
+// given CS, which are then enforced by all the commands that use that CS.
+//
+// Command:
+// - byte 0:      't'
+// - byte 1:      CS index, 0 - 3
+// - byte 2-5:    Setup time in nsecs, from CS assertion to the first SCK
+//                edge. Big endian.
+// - byte 6-9:    Hold time in nsecs, from the last SCK edge to CS release.
+//                Big endian.
+// - byte 10-13:  Min gap in nsecs, from CS release to the next CS assertion.
+//                Big endian.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+//
+// All the times are in the range 0 to kMaxCsTimingNs. The initial times
+// are zero.
+
+// Error codes:
+//  1 : CS index out of range.
+//  2 : Time value out of range.
+static class CsTimingCommandHandler : public CommandHandler {
+ public:
+  CsTimingCommandHandler() : CommandHandler("CS_TIMING") {}
+
+  virtual bool on_cmd_loop() override {
+    static_assert(sizeof(data_buffer) >= 13);
+    if (!read_serial_bytes(13)) {
+      return false;
+    }
+    const uint8_t cs_index = data_buffer[0];
+    CsTiming cs_timing;
+    cs_timing.setup_ns = read_uint32(&data_buffer[1]);
+    cs_timing.hold_ns = read_uint32(&data_buffer[5]);
+    cs_timing.gap_ns = read_uint32(&data_buffer[9]);
+
+    // Validate the command.
+    const uint8_t error_code =
+        (cs_index >= kNumCsPins) ? 0x01
+        : (cs_timing.setup_ns > kMaxCsTimingNs ||
+           cs_timing.hold_ns > kMaxCsTimingNs ||
+           cs_timing.gap_ns > kMaxCsTimingNs)
+            ? 0x02
+            : 0x00;
+    if (error_code) {
+      send_error_response(error_code);
+      return true;
+    }
+    cs_timings[cs_index] = cs_timing;
+
+    // All done Ok
+    transport::write('K');
+    return true;
+  }
+
+} cs_timing_cmd_handler;
+
+// DAISY CHAIN command. Performs a single SPI transaction with a chain of
+// devices whose data output is connected to the data input of the next
+// device, such as shift registers and LED drivers. The firmware orders the
+// per device data on the wire and splits the read bytes per device.
+//
+// Command:
+// - byte 0:    'd'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 3,4:  Number of devices N in the chain. Big endian. Should be
+//              at least 1.
+// - byte 5,6:  Number of bytes W per device. Big endian. Should be in the
+//              range 1 to kMaxTransactionBytes. N * W should not exceed
+//              kMaxChainBytes.
+// - Byte 7...  N * W data bytes to write, W bytes per device. Starting
+//              with device 0, which is the device whose data input is
+//              connected to the adapter's MOSI.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1,2:  Number read bytes being return. This is zero if config.b4 is
+//              zero, else it's N * W.
+// - byte 3...  Returned read bytes, W bytes per device, starting with
+//              device 0.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4   : Include bytes read in response
+// 5   : Reserved. Should be 0.
+// 6   : Reserved. Should be 0.
+// 7   : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Number of devices out of range.
+//  2 : Number of bytes per device out of range.
+//  3 : Total number of bytes out of range.
+//  4 : Speed byte is out of range.
+static class DaisyChainCommandHandler : public CommandHandler {
+ public:
+  DaisyChainCommandHandler() : CommandHandler("DAISY_CHAIN") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 6);
+      if (!read_serial_bytes(6)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[0] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
+      _return_read_bytes = data_buffer[0] & 0b10000;
+      _speed_units = data_buffer[1];
+      _num_devices = (((uint16_t)data_buffer[2]) << 8) + data_buffer[3];
+      _device_bytes = (((uint16_t)data_buffer[4]) << 8) + data_buffer[5];
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_num_devices < 1) ? 0x01
+          : (_device_bytes < 1 || _device_bytes > kMaxTransactionBytes)
+              ? 0x02
+          : ((uint32_t)_num_devices * _device_bytes > kMaxChainBytes) ? 0x03
+          : (_speed_units < 1 || _speed_units > 160)                  ? 0x04
+                                                                      : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+    }
+
+    // Read the data of each device into its slot in the wire order. The
+    // data of the last device is shifted out first.
+    static_assert(sizeof(data_buffer) >= kMaxTransactionBytes);
+    while (_devices_read < _num_devices) {
+      if (!read_serial_bytes(_device_bytes)) {
+        return false;
+      }
+      memcpy(device_slot(_devices_read), data_buffer, _device_bytes);
+      data_size = 0;
+      _devices_read++;
+    }
+
+    // Perform the SPI transaction using chain_buffer as TX/RX buffer.
+    const uint16_t total_bytes = _num_devices * _device_bytes;
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(chain_buffer, total_bytes);
+    end_spi_transaction();
+
+    // All done. Send OK response. The bytes from the last device are read
+    // first.
+    transport::write('K');
+    const uint16_t response_count = _return_read_bytes ? total_bytes : 0;
+    transport::write(response_count >> 8);    // Count MSB
+    transport::write(response_count & 0xff);  // Count LSB
+    if (response_count) {
+      for (uint16_t i = 0; i < _num_devices; i++) {
+        transport::write(device_slot(i), _device_bytes);
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  bool _return_read_bytes;
+  uint8_t _speed_units;
+  uint16_t _num_devices;
+  uint16_t _device_bytes;
+
+  uint16_t _devices_read;
+
+  // Returns the location in chain_buffer of the given device data.
+  uint8_t* device_slot(uint16_t device_index) {
+    return &chain_buffer[(_num_devices - 1 - device_index) * _device_bytes];
+  }
+
+  void reset() {
+    _got_cmd_header = false;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _return_read_bytes = false;
+    _speed_units = 0;
+    _num_devices = 0;
+    _device_bytes = 0;
+    _devices_read = 0;
+  }
+
+} daisy_chain_cmd_handler;
+
+// QSPI command. Performs a single dual or quad SPI transaction, such as
+// a fast read or a quad page program of a serial flash. The transaction
+// consists of optional command, address and dummy phases, followed by
+// a data phase. Uses the aux pins 4-7 as IO0-IO3 and the regular SCK pin.
+// The aux pins settings are restored after the transaction. Only SPI mode
+// 0 is supported.
+//
+// Command:
+// - byte 0:    'q'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Lines byte, see below.
+// - byte 3:    Number of address bytes. Valid range is [0, 4].
+// - byte 4:    Number of dummy clock cycles.
+// - byte 5,6:  Speed in 25Khz steps. Big endian. Valid range is [1, 800].
+// - byte 7:    Command byte. Ignored if config.b3 is zero.
+// - byte 8-11: Address, big endian. If the number of address bytes is less
+//              than 4, only the last bytes are sent.
+// - byte 12,13: Number of data bytes. Big endian. For writes, in the range
+//              0 to kMaxTransactionBytes.
+// - Byte 14... For writes, the data bytes to write.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1,2:  Number of read bytes being returned. Zero for writes.
+// - byte 3...  Returned read bytes.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2   : Data direction. 1 for write, 0 for read.
+// 3   : Has command byte.
+// 4-7 : Reserved. Should be 0.
+
+// Request lines byte. Each field is 0, 1 or 2 for 1, 2 or 4 data lines.
+// 0,1 : Command phase lines.
+// 2,3 : Address phase lines.
+// 4,5 : Data phase lines.
+// 6,7 : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Invalid lines byte.
+//  2 : Number of address bytes out of range.
+//  3 : Speed out of range.
+//  4 : Number of write bytes out of range.
+//  5 : PIO resources not available.
+static class QspiCommandHandler : public CommandHandler {
+ public:
+  QspiCommandHandler() : CommandHandler("QSPI") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 13);
+      if (!read_serial_bytes(13)) {
+        return false;
+      }
+      // Parse the command header
+      const uint8_t config = data_buffer[0];
+      _cs_index = config & 0b11;
+      _is_write = config & 0b100;
+      _has_cmd_byte = config & 0b1000;
+      const uint8_t lines = data_buffer[1];
+      _cmd_width = 1 << (lines & 0b11);
+      _addr_width = 1 << ((lines >> 2) & 0b11);
+      _data_width = 1 << ((lines >> 4) & 0b11);
+      _addr_count = data_buffer[2];
+      _dummy_cycles = data_buffer[3];
+      _speed_units = (((uint16_t)data_buffer[4]) << 8) + data_buffer[5];
+      _cmd_byte = data_buffer[6];
+      memcpy(_addr_bytes, &data_buffer[7], 4);
+      _data_count = (((uint16_t)data_buffer[11]) << 8) + data_buffer[12];
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint32_t frequency_hz = ((uint32_t)_speed_units) * 25000;
+      const uint8_t error_code =
+          (_cmd_width > 4 || _addr_width > 4 || _data_width > 4 ||
+           (lines & 0b11000000))
+              ? 0x01
+          : (_addr_count > 4) ? 0x02
+          : (_speed_units < 1 || frequency_hz > qspi::kMaxFrequencyHz)
+              ? 0x03
+          : (_is_write && _data_count > kMaxTransactionBytes) ? 0x04
+                                                              : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+    }
+
+    // Read the bytes to write.
+    if (_is_write) {
+      static_assert(sizeof(data_buffer) >= kMaxTransactionBytes);
+      if (!read_serial_bytes(_data_count)) {
+        return false;
+      }
+    }
+
+    // A held CS is released before we touch the clock and data pins, so
+    // the held device doesn't see them change.
+    release_held_cs();
+
+    // The SCK idle level of the SPI peripheral should match mode 0 when
+    // we return the pin to it.
+    track_spi_clock_polarity(SPI_MODE0);
+    if (!qspi::begin_transaction(((uint32_t)_speed_units) * 25000)) {
+      send_error_response(0x05);
+      return true;
+    }
+    cs_on(_cs_index);
+    if (_has_cmd_byte) {
+      qspi::write(_cmd_width, &_cmd_byte, 1);
+    }
+    qspi::write(_addr_width, &_addr_bytes[4 - _addr_count], _addr_count);
+    qspi::dummy_cycles(_dummy_cycles);
+
+    if (_is_write) {
+      qspi::write(_data_width, data_buffer, _data_count);
+      all_cs_off();
+      qspi::end_transaction();
+      transport::write('K');
+      transport::write(0x00);  // Count MSB
+      transport::write(0x00);  // Count LSB
+      return true;
+    }
+
+    // Stream the read bytes in chunks, while keeping CS asserted.
+    transport::write('K');
+    transport::write(_data_count >> 8);    // Count MSB
+    transport::write(_data_count & 0xff);  // Count LSB
+    uint16_t bytes_left = _data_count;
+    while (bytes_left) {
+      const uint16_t n = (bytes_left < sizeof(data_buffer))
+                             ? bytes_left
+                             : sizeof(data_buffer);
+      qspi::read(_data_width, data_buffer, n);
+      transport::write(data_buffer, n);
+      bytes_left -= n;
+    }
+    all_cs_off();
+    qspi::end_transaction();
+    return true;
+  }
+
+ private:
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  bool _is_write;
+  bool _has_cmd_byte;
+  uint8_t _cmd_width;
+  uint8_t _addr_width;
+  uint8_t _data_width;
+  uint8_t _addr_count;
+  uint8_t _dummy_cycles;
+  uint16_t _speed_units;
+  uint8_t _cmd_byte;
+  uint8_t _addr_bytes[4];
+  uint16_t _data_count;
+
+  void reset() {
+    _got_cmd_header = false;
+    _cs_index = 0;
+    _is_write = false;
+    _has_cmd_byte = false;
+    _cmd_width = 1;
+    _addr_width = 1;
+    _data_width = 1;
+    _addr_count = 0;
+    _dummy_cycles = 0;
+    _speed_units = 0;
+    _cmd_byte = 0;
+    memset(_addr_bytes, 0, sizeof(_addr_bytes));
+    _data_count = 0;
+  }
+
+} qspi_cmd_handler;
+
+// FLASH command. Performs high level operations with a SPI NOR flash,
+// such as reading, programming and erasing, including the waiting for
+// the flash to complete them. Uses the common flash opcodes.
+//
+// Command:
+// - byte 0:    'f'
+// - byte 1:    Operation, see below.
+// - byte 2:    Config byte, see below.
+// - byte 3:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 4...  Operation arguments, see below.
+//
+// Operations:
+// - 'j' JEDEC ID. No arguments. Returns the 3 bytes of the ID.
+// - 'r' Fast read. Arguments are a 4 bytes address and a 4 bytes count N,
+//       big endian. Returns a 4 bytes count N, big endian, followed by the
+//       N data bytes.
+// - 'p' Program. Arguments are a 4 bytes address and a 4 bytes count N,
+//       big endian, followed by the N data bytes to write. The data is
+//       split on the page boundaries and the flash is polled for
+//       completion after each page. Returns no data.
+// - 'e' Erase. Arguments are the erase type byte, per the list below, and
+//       a 4 bytes address, big endian. Waits for completion. Returns no
+//       data.
+//
+// Erase types:
+//  0 : 4KB sector erase.
+//  1 : 32KB block erase.
+//  2 : 64KB block erase.
+//  3 : Chip erase. The address is ignored.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1...  The data that is returned by the operation.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4   : 4 bytes addresses. Otherwise, 3 bytes addresses are sent.
+// 5   : Reserved. Should be 0.
+// 6   : Reserved. Should be 0.
+// 7   : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Unknown operation.
+//  2 : Speed byte is out of range.
+//  3 : Erase type is out of range.
+//  4 : Address range is out of the addressable range.
+//  5 : Timeout while waiting for the flash to complete an operation.
+//
+// For program, errors are sent after receiving all the data bytes.
+static class FlashCommandHandler : public CommandHandler {
+ public:
+  FlashCommandHandler() : CommandHandler("FLASH") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      // The operation determines the header size.
+      static_assert(sizeof(data_buffer) >= 11);
+      if (!read_serial_bytes(3)) {
+        return false;
+      }
+      _op = data_buffer[0];
+      const uint8_t header_size = (_op == 'r' || _op == 'p') ? 11
+                                  : (_op == 'e')             ? 8
+                                                             : 3;
+      if (!read_serial_bytes(header_size)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[1] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[1] >> 2) & 0b11);
+      _four_bytes_addr = data_buffer[1] & 0b10000;
+      _speed_units = data_buffer[2];
+      if (_op == 'e') {
+        _erase_type = data_buffer[3];
+        _addr = read_uint32(&data_buffer[4]);
+      } else if (header_size == 11) {
+        _addr = read_uint32(&data_buffer[3]);
+        _count = read_uint32(&data_buffer[7]);
+      }
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint64_t addr_limit = _four_bytes_addr ? (1ull << 32) : (1 << 24);
+      const uint8_t error_code =
+          (_op != 'j' && _op != 'r' && _op != 'p' && _op != 'e') ? 0x01
+          : (_speed_units < 1 || _speed_units > 160)             ? 0x02
+          : (_op == 'e' && _erase_type > 3)                      ? 0x03
+          : ((uint64_t)_addr + _count > addr_limit)              ? 0x04
+                                                                 : 0x00;
+      // For program, the error is sent after consuming the data below.
+      if (error_code && _op != 'p') {
+        send_error_response(error_code);
+        return true;
+      }
+      _error_code = error_code;
+
+      switch (_op) {
+        case 'j':
+          read_jedec_id();
+          return true;
+        case 'r':
+          fast_read();
+          return true;
+        case 'e':
+          erase();
+          return true;
+      }
+    }
+
+    // Program. Read and program the data a page at a time. On error, we
+    // still consume the rest of the data to stay in sync with the host.
+    static_assert(sizeof(data_buffer) >= kFlashPageBytes);
+    while (_bytes_done < _count) {
+      const uint32_t addr = _addr + _bytes_done;
+      const uint32_t page_left = kFlashPageBytes - (addr % kFlashPageBytes);
+      const uint16_t n = std::min(page_left, _count - _bytes_done);
+      if (!read_serial_bytes(n)) {
+        return false;
+      }
+      if (!_error_code) {
+        write_enable();
+        begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+        send_opcode_and_addr(0x02, addr);
+        SPI.transfer(data_buffer, n);
+        end_spi_transaction();
+        if (!wait_while_busy(kPageProgramTimeoutMillis)) {
+          _error_code = 0x05;
+        }
+      }
+      data_size = 0;
+      _bytes_done += n;
+      extend_cmd_timeout();
+    }
+
+    if (_error_code) {
+      send_error_response(_error_code);
+      return true;
+    }
+    transport::write('K');
+    return true;
+  }
+
+ private:
+  static constexpr uint16_t kFlashPageBytes = 256;
+  static constexpr uint32_t kPageProgramTimeoutMillis = 20;
+
+  // Opcode and max time of each erase type.
+  struct EraseType {
+    uint8_t opcode;
+    uint32_t timeout_millis;
+  };
+  static constexpr EraseType kEraseTypes[] = {
+      {0x20, 1000},    // 4KB sector.
+      {0x52, 2000},    // 32KB block.
+      {0xd8, 4000},    // 64KB block.
+      {0xc7, 400000},  // Chip.
+  };
+
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _op;
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  bool _four_bytes_addr;
+  uint8_t _speed_units;
+  uint8_t _erase_type;
+  uint32_t _addr;
+  uint32_t _count;
+
+  uint32_t _bytes_done;
+  uint8_t _error_code;
+
+  // Sends an opcode followed by an address, within a transaction.
+  void send_opcode_and_addr(uint8_t opcode, uint32_t addr) {
+    uint8_t bfr[] = {opcode, (uint8_t)(addr >> 24), (uint8_t)(addr >> 16),
+                     (uint8_t)(addr >> 8), (uint8_t)addr};
+    if (_four_bytes_addr) {
+      SPI.transfer(bfr, 5);
+    } else {
+      bfr[1] = opcode;
+      SPI.transfer(&bfr[1], 4);
+    }
+  }
+
+  void write_enable() {
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(0x06);
+    end_spi_transaction();
+  }
+
+  // Polls the WIP bit of the status register until it's cleared. Returns
+  // false if timeout.
+  bool wait_while_busy(uint32_t timeout_millis) {
+    Timer timer;
+    for (;;) {
+      uint8_t bfr[] = {0x05, 0x00};
+      begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+      SPI.transfer(bfr, 2);
+      end_spi_transaction();
+      if (!(bfr[1] & 0x01)) {
+        return true;
+      }
+      if (timer.elapsed_millis(millis()) > timeout_millis) {
+        return false;
+      }
+      extend_cmd_timeout();
+    }
+  }
+
+  void read_jedec_id() {
+    uint8_t bfr[] = {0x9f, 0x00, 0x00, 0x00};
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(bfr, 4);
+    end_spi_transaction();
+    transport::write('K');
+    transport::write(&bfr[1], 3);
+  }
+
+  // Streams the read bytes in chunks, within a single flash read.
+  void fast_read() {
+    transport::write('K');
+    write_uint32(_count);
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    send_opcode_and_addr(0x0b, _addr);
+    SPI.transfer(0x00);  // Dummy byte.
+    uint32_t bytes_left = _count;
+    while (bytes_left) {
+      const uint16_t n =
+          std::min(bytes_left, (uint32_t)sizeof(data_buffer));
+      memset(data_buffer, 0, n);
+      SPI.transfer(data_buffer, n);
+      transport::write(data_buffer, n);
+      bytes_left -= n;
+    }
+    end_spi_transaction();
+  }
+
+  void erase() {
+    const EraseType& erase_type = kEraseTypes[_erase_type];
+    write_enable();
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    if (_erase_type == 3) {
+      SPI.transfer(erase_type.opcode);
+    } else {
+      send_opcode_and_addr(erase_type.opcode, _addr);
+    }
+    end_spi_transaction();
+    if (!wait_while_busy(erase_type.timeout_millis)) {
+      send_error_response(0x05);
+      return;
+    }
+    transport::write('K');
+  }
+
+  void reset() {
+    _got_cmd_header = false;
+    _op = 0;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _four_bytes_addr = false;
+    _speed_units = 0;
+    _erase_type = 0;
+    _addr = 0;
+    _count = 0;
+    _bytes_done = 0;
+    _error_code = 0;
+  }
+
+} flash_cmd_handler;
+
+// POLL command. Repeats a SPI transaction until a byte of the response
+// matches a given value under a mask, such as a busy bit of a status
+// register, and returns the last response. This way, waiting for a
+// device costs a single command regardless of how long it takes.
+//
+// Command:
+// - byte 0:    'p'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 3:    Number N of bytes per transaction. Valid range is
+//              [1, kMaxPollBytes].
+// - byte 4:    Index of the tested response byte. Should be less than N.
+// - byte 5:    Mask.
+// - byte 6:    Value. The polling ends when
+//              (response[index] & mask) == value.
+// - byte 7,8:  Interval between transactions in usecs. Big endian.
+// - byte 9,10: Max number of transactions. Big endian. Should be at
+//              least 1.
+// - byte 11,12: Timeout in millis. Big endian.
+// - Byte 13... The N bytes to write in each transaction.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1:    Result. 0 if matched, 1 if reached the max number of
+//              transactions, 2 if timeout.
+// - byte 2,3:  Number of transactions performed. Big endian.
+// - byte 4...  The N bytes read in the last transaction.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4-7 : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Number of bytes out of range.
+//  2 : Byte index out of range.
+//  3 : Max number of transactions is zero.
+//  4 : Speed byte is out of range.
+static class PollCommandHandler : public CommandHandler {
+ public:
+  PollCommandHandler() : CommandHandler("POLL") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 12);
+      if (!read_serial_bytes(12)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[0] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
+      _speed_units = data_buffer[1];
+      _num_bytes = data_buffer[2];
+      _byte_index = data_buffer[3];
+      _mask = data_buffer[4];
+      _value = data_buffer[5];
+      _interval_us = (((uint16_t)data_buffer[6]) << 8) + data_buffer[7];
+      _max_iterations = (((uint16_t)data_buffer[8]) << 8) + data_buffer[9];
+      _timeout_millis = (((uint16_t)data_buffer[10]) << 8) + data_buffer[11];
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_num_bytes < 1 || _num_bytes > kMaxPollBytes) ? 0x01
+          : (_byte_index >= _num_bytes)                  ? 0x02
+          : (!_max_iterations)                           ? 0x03
+          : (_speed_units < 1 || _speed_units > 160)     ? 0x04
+                                                         : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+    }
+
+    // Read the bytes to write.
+    static_assert(sizeof(data_buffer) >= kMaxPollBytes);
+    if (!read_serial_bytes(_num_bytes)) {
+      return false;
+    }
+
+    // Poll. The transactions use a copy of the written bytes since the
+    // transfer overwrites them with the read bytes.
+    uint8_t bfr[kMaxPollBytes];
+    uint16_t iterations = 0;
+    uint8_t result;
+    Timer timer;
+    for (;;) {
+      memcpy(bfr, data_buffer, _num_bytes);
+      begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+      SPI.transfer(bfr, _num_bytes);
+      end_spi_transaction();
+      iterations++;
+      if ((bfr[_byte_index] & _mask) == _value) {
+        result = 0;
+        break;
+      }
+      if (iterations >= _max_iterations) {
+        result = 1;
+        break;
+      }
+      if (timer.elapsed_millis(millis()) >= _timeout_millis) {
+        result = 2;
+        break;
+      }
+      extend_cmd_timeout();
+      delayMicroseconds(_interval_us);
+    }
+
+    // All done. Send OK response.
+    transport::write('K');
+    transport::write(result);
+    transport::write(iterations >> 8);    // Count MSB
+    transport::write(iterations & 0xff);  // Count LSB
+    transport::write(bfr, _num_bytes);
+    return true;
+  }
+
+ private:
+  static constexpr uint8_t kMaxPollBytes = 32;
+
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  uint8_t _speed_units;
+  uint8_t _num_bytes;
+  uint8_t _byte_index;
+  uint8_t _mask;
+  uint8_t _value;
+  uint16_t _interval_us;
+  uint16_t _max_iterations;
+  uint16_t _timeout_millis;
+
+  void reset() {
+    _got_cmd_header = false;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _speed_units = 0;
+    _num_bytes = 0;
+    _byte_index = 0;
+    _mask = 0;
+    _value = 0;
+    _interval_us = 0;
+    _max_iterations = 0;
+    _timeout_millis = 0;
+  }
+
+} poll_cmd_handler;
+
+// CRC command. Performs a SPI transaction that writes a few prefix bytes,
+// such as a flash read command and address, and then reads a stream of
+// bytes whose CRC is returned instead of the bytes themselves. This allows
+// to verify large device contents, such as a flash image, at the SPI
+// speed, with only a few bytes over the USB.
+//
+// Command:
+// - byte 0:    'r'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 3:    Number P of prefix bytes. Valid range is [0, 16].
+// - byte 4-7:  Number N of bytes to read after the prefix bytes. Big endian.
+// - Byte 8...  The P prefix bytes to write.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1-4:  The CRC of the N read bytes. Big endian. The bytes read
+//              while writing the prefix bytes are ignored.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4   : CRC type, per spi_hw::CrcType. 0 for CRC-32 (as in zlib), 1 for
+//       CRC-16/CCITT-FALSE.
+// 5-7 : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Number of prefix bytes out of range.
+//  2 : Speed byte is out of range.
+static class CrcCommandHandler : public CommandHandler {
+ public:
+  CrcCommandHandler() : CommandHandler("CRC") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 7);
+      if (!read_serial_bytes(7)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[0] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
+      _crc_type = (spi_hw::CrcType)((data_buffer[0] >> 4) & 0b1);
+      _speed_units = data_buffer[1];
+      _num_prefix_bytes = data_buffer[2];
+      _num_read_bytes = read_uint32(&data_buffer[3]);
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_num_prefix_bytes > kMaxPrefixBytes)      ? 0x01
+          : (_speed_units < 1 || _speed_units > 160) ? 0x02
+                                                     : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+    }
+
+    // Read the prefix bytes.
+    static_assert(sizeof(data_buffer) >= kMaxPrefixBytes);
+    if (!read_serial_bytes(_num_prefix_bytes)) {
+      return false;
+    }
+
+    // Perform the SPI transaction.
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(data_buffer, _num_prefix_bytes);
+    const uint32_t crc = spi_hw::read_crc(_crc_type, _num_read_bytes);
+    end_spi_transaction();
+
+    // All done. Send OK response.
+    transport::write('K');
+    write_uint32(crc);
+    return true;
+  }
+
+ private:
+  static constexpr uint8_t kMaxPrefixBytes = 16;
+
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  spi_hw::CrcType _crc_type;
+  uint8_t _speed_units;
+  uint8_t _num_prefix_bytes;
+  uint32_t _num_read_bytes;
+
+  void reset() {
+    _got_cmd_header = false;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _crc_type = spi_hw::kCrc32;
+    _speed_units = 0;
+    _num_prefix_bytes = 0;
+    _num_read_bytes = 0;
+  }
+
+} crc_cmd_handler;
+
+// VERIFY command. Performs a SPI transaction that writes a few prefix
+// bytes, such as a flash read command and address, and then compares the
+// bytes read to expected bytes that are streamed from the host. Only the
+// result is returned, so verifying costs almost no return bandwidth.
+//
+// Command:
+// - byte 0:    'v'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 3:    Number P of prefix bytes. Valid range is [0, 16].
+// - byte 4-7:  Number N of bytes to verify after the prefix bytes. Big
+//              endian.
+// - Byte 8...  The P prefix bytes to write, followed by the N expected
+//              bytes.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1:    Result. 0 if all the bytes matched, 1 otherwise.
+// - byte 2-5:  Offset of the first mismatching byte, relative to the first
+//              byte after the prefix. Big endian. 0xffffffff if all the
+//              bytes matched.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4-7 : Reserved. Should be 0.
+
+// Error codes:
+//  1 : Number of prefix bytes out of range.
+//  2 : Speed byte is out of range.
+static class VerifyCommandHandler : public CommandHandler {
+ public:
+  VerifyCommandHandler() : CommandHandler("VERIFY") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 7);
+      if (!read_serial_bytes(7)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[0] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
+      _speed_units = data_buffer[1];
+      _num_prefix_bytes = data_buffer[2];
+      _num_bytes = read_uint32(&data_buffer[3]);
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_num_prefix_bytes > kMaxPrefixBytes)      ? 0x01
+          : (_speed_units < 1 || _speed_units > 160) ? 0x02
+                                                     : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+    }
+
+    // Read the prefix bytes and start the transaction. The transaction
+    // stays open while the expected bytes arrive.
+    if (!_in_transaction) {
+      static_assert(sizeof(data_buffer) >= kMaxPrefixBytes);
+      if (!read_serial_bytes(_num_prefix_bytes)) {
+        return false;
+      }
+      begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+      SPI.transfer(data_buffer, _num_prefix_bytes);
+      data_size = 0;
+      _in_transaction = true;
+    }
+
+    // Verify the expected bytes, a chunk at a time.
+    while (_bytes_done < _num_bytes) {
+      const uint16_t n =
+          std::min(_num_bytes - _bytes_done, (uint32_t)sizeof(data_buffer));
+      if (!read_serial_bytes(n)) {
+        return false;
+      }
+      verify_chunk(n);
+      data_size = 0;
+      _bytes_done += n;
+      extend_cmd_timeout();
+    }
+    end_spi_transaction();
+    _in_transaction = false;
+
+    // All done. Send OK response.
+    transport::write('K');
+    transport::write(_mismatch_offset == kNoMismatch ? 0 : 1);
+    write_uint32(_mismatch_offset);
+    return true;
+  }
+
+  virtual void on_cmd_aborted() override {
+    if (_in_transaction) {
+      end_spi_transaction();
+      _in_transaction = false;
+    }
+  }
+
+ private:
+  static constexpr uint8_t kMaxPrefixBytes = 16;
+  static constexpr uint32_t kNoMismatch = 0xffffffff;
+
+  bool _got_cmd_header = false;
+  bool _in_transaction = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  uint8_t _speed_units;
+  uint8_t _num_prefix_bytes;
+  uint32_t _num_bytes;
+
+  uint32_t _bytes_done;
+  uint32_t _mismatch_offset;
+
+  // Reads the next n bytes from the device and compares them to the
+  // expected bytes in data_buffer. The device bytes are read in small
+  // blocks to keep the stack usage low.
+  void verify_chunk(uint16_t n) {
+    uint8_t bfr[32];
+    for (uint16_t i = 0; i < n; i += sizeof(bfr)) {
+      const uint16_t block_size =
+          std::min((uint16_t)(n - i), (uint16_t)sizeof(bfr));
+      memset(bfr, 0, block_size);
+      SPI.transfer(bfr, block_size);
+      if (_mismatch_offset != kNoMismatch) {
+        continue;
+      }
+      for (uint16_t j = 0; j < block_size; j++) {
+        if (bfr[j] != data_buffer[i + j]) {
+          _mismatch_offset = _bytes_done + i + j;
+          break;
+        }
+      }
+    }
+  }
+
+  void reset() {
+    _got_cmd_header = false;
+    _in_transaction = false;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _speed_units = 0;
+    _num_prefix_bytes = 0;
+    _num_bytes = 0;
+    _bytes_done = 0;
+    _mismatch_offset = kNoMismatch;
+  }
+
+} verify_cmd_handler;
+
+// DISPLAY command. Updates a monochrome page based display, such as a
+// SSD1306 OLED, from a full frame, sending to the display only the
+// columns that changed since the last frame. The firmware keeps a mirror
+// of the display RAM of the last updated display for the diff, so an
+// update of another display sends its full frame. The display's DC pin is
+// driven by an aux pin which should be set as an output.
+//
+// Command:
+// - byte 0:    'o'
+// - byte 1:    Config byte, see below.
+// - byte 2:    Speed in 25Khz steps. Valid range is [1, 160]
+// - byte 3:    DC aux pin index. Valid range is [0, 7].
+// - byte 4:    Number of columns W. Valid range is [1, 128].
+// - byte 5:    Number of pages P, each of 8 pixel rows. Valid range is
+//              [1, 8].
+// - byte 6:    Display RAM column of the first column. Typically 0 for
+//              SSD1306 and 2 for SH1106.
+// - Byte 7...  The W * P bytes of the frame, page by page, in the display
+//              RAM format.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1,2:  Number of frame bytes that were sent to the display. Big
+//              endian.
+
+// Request config byte bits
+// 0,1 : CS index.
+// 2:3 : SPI mode, per arduino::SPIMode.
+// 4   : Full update. Send the entire frame, regardless of the mirror.
+// 5   : SH1106 addressing. Use the page and column address commands of
+//       SH1106 rather than the column and page range commands of SSD1306.
+// 6,7 : Reserved. Should be 0.
+
+// Error codes:
+//  1 : DC aux pin index out of range.
+//  2 : Number of columns out of range.
+//  3 : Number of pages out of range.
+//  4 : Speed byte is out of range.
+//
+// Errors are sent after receiving the W * P bytes of the frame.
+static class DisplayCommandHandler : public CommandHandler {
+ public:
+  DisplayCommandHandler() : CommandHandler("DISPLAY") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      static_assert(sizeof(data_buffer) >= 6);
+      if (!read_serial_bytes(6)) {
+        return false;
+      }
+      // Parse the command header
+      _cs_index = data_buffer[0] & 0b11;
+      _spi_mode = (SPIMode)((data_buffer[0] >> 2) & 0b11);
+      const bool full_update = data_buffer[0] & 0b10000;
+      _sh1106 = data_buffer[0] & 0b100000;
+      _speed_units = data_buffer[1];
+      _dc_aux_pin = data_buffer[2];
+      _columns = data_buffer[3];
+      _pages = data_buffer[4];
+      _column_offset = data_buffer[5];
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_dc_aux_pin >= kNumAuxPins)                ? 0x01
+          : (_columns < 1 || _columns > kMaxColumns)  ? 0x02
+          : (_pages < 1 || _pages > kMaxPages)        ? 0x03
+          : (_speed_units < 1 || _speed_units > 160) ? 0x04
+                                                      : 0x00;
+      // On error, we still consume the frame to stay in sync with the
+      // host, and send the error after it.
+      _error_code = error_code;
+
+      // The mirror is valid only for the same display, as selected by the
+      // CS and DC pins, with the same geometry and addressing.
+      if (full_update || _cs_index != _mirror_cs_index ||
+          _dc_aux_pin != _mirror_dc_aux_pin || _sh1106 != _mirror_sh1106 ||
+          _columns != _mirror_columns || _pages != _mirror_pages ||
+          _column_offset != _mirror_column_offset) {
+        _mirror_columns = 0;
+      }
+    }
+
+    // Update the display a page at a time, as the frame arrives. On error,
+    // the header's geometry may be out of range, but a page still fits in
+    // data_buffer.
+    static_assert(sizeof(data_buffer) >= UINT8_MAX);
+    while (_pages_done < _pages) {
+      if (!read_serial_bytes(_columns)) {
+        return false;
+      }
+      if (!_error_code) {
+        update_page(_pages_done);
+      }
+      data_size = 0;
+      _pages_done++;
+      extend_cmd_timeout();
+    }
+    if (_error_code) {
+      send_error_response(_error_code);
+      return true;
+    }
+    _mirror_cs_index = _cs_index;
+    _mirror_dc_aux_pin = _dc_aux_pin;
+    _mirror_sh1106 = _sh1106;
+    _mirror_columns = _columns;
+    _mirror_pages = _pages;
+    _mirror_column_offset = _column_offset;
+
+    // All done. Send OK response.
+    transport::write('K');
+    transport::write(_bytes_sent >> 8);    // Count MSB
+    transport::write(_bytes_sent & 0xff);  // Count LSB
+    return true;
+  }
+
+  virtual void on_cmd_aborted() override {
+    // The display content is unknown.
+    _mirror_columns = 0;
+  }
+
+ private:
+  static constexpr uint8_t kMaxColumns = 128;
+  static constexpr uint8_t kMaxPages = 8;
+
+  // The mirror of the display RAM, and the display it mirrors. Valid only
+  // if _mirror_columns is non zero.
+  uint8_t _mirror[kMaxPages][kMaxColumns];
+  uint8_t _mirror_cs_index = 0;
+  uint8_t _mirror_dc_aux_pin = 0;
+  bool _mirror_sh1106 = false;
+  uint8_t _mirror_columns = 0;
+  uint8_t _mirror_pages = 0;
+  uint8_t _mirror_column_offset = 0;
+
+  bool _got_cmd_header = false;
+
+  // Command header info.
+  uint8_t _cs_index;
+  SPIMode _spi_mode;
+  bool _sh1106;
+  uint8_t _speed_units;
+  uint8_t _dc_aux_pin;
+  uint8_t _columns;
+  uint8_t _pages;
+  uint8_t _column_offset;
+
+  uint8_t _pages_done;
+  uint16_t _bytes_sent;
+  uint8_t _error_code;
+
+  // Sends the changed columns of a page, which is in data_buffer, and
+  // updates the mirror.
+  void update_page(uint8_t page) {
+    uint8_t* const mirror_page = _mirror[page];
+    uint8_t first = 0;
+    uint8_t last = _columns - 1;
+    if (_mirror_columns) {
+      while (first < _columns && data_buffer[first] == mirror_page[first]) {
+        first++;
+      }
+      if (first == _columns) {
+        return;
+      }
+      while (data_buffer[last] == mirror_page[last]) {
+        last--;
+      }
+    }
+    const uint8_t n = last - first + 1;
+    memcpy(&mirror_page[first], &data_buffer[first], n);
+
+    // Set the display RAM address.
+    const uint8_t col_start = _column_offset + first;
+    const uint8_t col_end = _column_offset + last;
+    uint8_t cmd[6];
+    uint8_t cmd_size;
+    if (_sh1106) {
+      cmd[0] = 0xb0 | page;
+      cmd[1] = 0x00 | (col_start & 0x0f);
+      cmd[2] = 0x10 | (col_start >> 4);
+      cmd_size = 3;
+    } else {
+      cmd[0] = 0x21;
+      cmd[1] = col_start;
+      cmd[2] = col_end;
+      cmd[3] = 0x22;
+      cmd[4] = page;
+      cmd[5] = page;
+      cmd_size = 6;
+    }
+    const uint8_t dc_gpio_pin = aux_pins[_dc_aux_pin];
+    digitalWrite(dc_gpio_pin, LOW);
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(cmd, cmd_size);
+    end_spi_transaction();
+
+    // Send the data. The transfer overwrites the buffer.
+    digitalWrite(dc_gpio_pin, HIGH);
+    begin_spi_transaction(1 << _cs_index, _spi_mode, _speed_units);
+    SPI.transfer(&data_buffer[first], n);
+    end_spi_transaction();
+    _bytes_sent += n;
+  }
+
+  void reset() {
+    _got_cmd_header = false;
+    _cs_index = 0;
+    _spi_mode = SPI_MODE0;
+    _sh1106 = false;
+    _speed_units = 0;
+    _dc_aux_pin = 0;
+    _columns = 0;
+    _pages = 0;
+    _column_offset = 0;
+    _pages_done = 0;
+    _bytes_sent = 0;
+    _error_code = 0;
+  }
+
+} display_cmd_handler;
+
+// STATS command. Returns timing and error statistics of the command
+// processing, see stats.h.
+//
+// Command:
+// - byte 0:    'x'
+// - byte 1:    Flags byte, see below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1:    Number of phases P, per stats::Phase.
+// - byte 2...  P phase summaries, in stats::Phase order.
+// - next 4:    Number of command timeouts. Big endian.
+// - next 4:    Number of unknown command selectors. Big endian.
+// - next 1:    Number of commands C that have statistics.
+// - next ...   C command entries. Each is the selector char followed by
+//              a summary and a 4 bytes error count, big endian.
+//
+// Each summary is 4 big endian uint32 values: count, min, max and mean,
+// with the times in usecs. The statistics of this command are updated
+// after the response.
+
+// Request flags byte bits
+// 0   : Reset the statistics after reading them.
+// 1-7 : Reserved. Should be 0.
+static class StatsCommandHandler : public CommandHandler {
+ public:
+  StatsCommandHandler() : CommandHandler("STATS") {}
+
+  virtual bool on_cmd_loop() override {
+    static_assert(sizeof(data_buffer) >= 1);
+    if (!read_serial_bytes(1)) {
+      return false;
+    }
+    const bool reset_stats = data_buffer[0] & 0b1;
+
+    transport::write('K');
+    transport::write(stats::kNumPhases);
+    for (uint8_t i = 0; i < stats::kNumPhases; i++) {
+      write_summary(stats::phase((stats::Phase)i));
+    }
+    write_uint32(stats::timeouts());
+    write_uint32(stats::unknown_commands());
+
+    // Commands with statistics.
+    uint8_t num_commands = 0;
+    for (char c = 'a'; c <= 'z'; c++) {
+      if (stats::command(c)->durations.count) {
+        num_commands++;
+      }
+    }
+    transport::write(num_commands);
+    for (char c = 'a'; c <= 'z'; c++) {
+      const stats::CommandStats* cmd_stats = stats::command(c);
+      if (cmd_stats->durations.count) {
+        transport::write(c);
+        write_summary(cmd_stats->durations);
+        write_uint32(cmd_stats->errors);
+      }
+    }
+
+    if (reset_stats) {
+      stats::reset();
+    }
+    return true;
+  }
+
+ private:
+  void write_summary(const stats::Summary& summary) {
+    write_uint32(summary.count);
+    write_uint32(summary.min_us);
+    write_uint32(summary.max_us);
+    write_uint32(summary.mean_us());
+  }
+
+} stats_cmd_handler;
+
+// TRACE command. Returns the trace of the recent commands, see trace.h.
+//
+// Command:
+// - byte 0:    'l'
+// - byte 1:    Flags byte, see below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1,2:  Number of entries N. Big endian.
+// - byte 3:    Entry size in bytes. Currently 20.
+// - byte 4...  N entries, oldest first. This command is traced after its
+//              response.
+//
+// Entry format, multi byte values are big endian:
+// - byte 0-3:    Command start time, in usecs since startup.
+// - byte 4-7:    Command duration in usecs.
+// - byte 8,9:    Number of command bytes received, including the
+//                selector. Saturated at 0xffff.
+// - byte 10,11:  Number of response bytes sent. Saturated at 0xffff.
+// - byte 12:     Command selector char.
+// - byte 13:     Status. 0 if OK, 0xff if timeout, otherwise the error
+//                code of the error response.
+// - byte 14:     CS mask of the last SPI transaction, one bit per CS
+//                index. 0 if none.
+// - byte 15:     SPI mode of the last SPI transaction.
+// - byte 16:     Speed of the last SPI transaction, in 25Khz steps.
+// - byte 17:     Transport channel of the command.
+// - byte 18,19:  Reserved. Always 0.
+
+// Request flags byte bits
+// 0   : Clear the trace after reading it.
+// 1-7 : Reserved. Should be 0.
+static class TraceCommandHandler : public CommandHandler {
+ public:
+  TraceCommandHandler() : CommandHandler("TRACE") {}
+
+  virtual bool on_cmd_loop() override {
+    static_assert(sizeof(data_buffer) >= 1);
+    if (!read_serial_bytes(1)) {
+      return false;
+    }
+    const bool clear_trace = data_buffer[0] & 0b1;
+
+    const uint16_t n = trace::size();
+    transport::write('K');
+    transport::write(n >> 8);    // Count MSB
+    transport::write(n & 0xff);  // Count LSB
+    transport::write(kEntrySize);
+    for (uint16_t i = 0; i < n; i++) {
+      const trace::Entry& entry = trace::get(i);
+      write_uint32(entry.start_us);
+      write_uint32(entry.duration_us);
+      write_uint16_saturated(entry.bytes_in);
+      write_uint16_saturated(entry.bytes_out);
+      transport::write(entry.selector);
+      transport::write(entry.status);
+      transport::write(entry.cs_mask);
+      transport::write(entry.spi_mode);
+      transport::write(entry.speed_units);
+      transport::write(entry.channel);
+      transport::write(0x00);
+      transport::write(0x00);
+    }
+
+    if (clear_trace) {
+      trace::clear();
+    }
+    return true;
+  }
+
+ private:
+  static constexpr uint8_t kEntrySize = 20;
+
+  void write_uint16_saturated(uint32_t value) {
+    const uint16_t v = std::min(value, (uint32_t)0xffff);
+    transport::write(v >> 8);
+    transport::write(v & 0xff);
+  }
+
+} trace_cmd_handler;
+
+// INIT SCRIPT command. Stores, reads or clears the init script, a command
+// script that is stored in the adapter's flash and is run on startup,
+// before the host connects, see init_script.h. The script is a sequence
+// of SEND, AUX MODE, AUX WRITE and CS TIMING commands, in the same format
+// as sent by the host. Their responses are discarded and the script stops
+// on the first other command selector.
+//
+// Command:
+// - byte 0:    'u'
+// - byte 1:    Operation, see below.
+// - byte 2...  Operation arguments, see below.
+//
+// Operations:
+// - 's' Store. Arguments are a 2 bytes size N, big endian, followed by the
+//       N bytes of the script. Replaces the current script. N = 0 stores
+//       an empty script. Returns no data.
+// - 'r' Read. No arguments. Returns a 2 bytes size N, big endian,
+//       followed by the N bytes of the stored script. N is 0 if none.
+// - 'c' Clear. No arguments. Erases the stored script. Returns no data.
+//
+// Error response:
+// - byte 0:    'E' for error.
+// - byte 1:    Error code, per the list below.
+//
+// OK response
+// - byte 0:    'K' for 'OK'.
+// - byte 1...  The data that is returned by the operation.
+
+// Error codes:
+//  1 : Unknown operation.
+//  2 : Script size is out of range. If detected while storing, sent
+//      after receiving all the script bytes.
+//  3 : Verification of the stored script failed. Sent after receiving
+//      all the script bytes.
+static class InitScriptCommandHandler : public CommandHandler {
+ public:
+  InitScriptCommandHandler() : CommandHandler("INIT SCRIPT") { reset(); }
+
+  virtual void on_cmd_entered() override { reset(); }
+
+  virtual bool on_cmd_loop() override {
+    // Read command header.
+    if (!_got_cmd_header) {
+      // The operation determines the header size.
+      static_assert(sizeof(data_buffer) >= 3);
+      if (!read_serial_bytes(1)) {
+        return false;
+      }
+      _op = data_buffer[0];
+      if (_op == 's') {
+        if (!read_serial_bytes(3)) {
+          return false;
+        }
+        _size = (((uint16_t)data_buffer[1]) << 8) + data_buffer[2];
+      }
+      data_size = 0;
+      _got_cmd_header = true;
+
+      // Validate the command header.
+      const uint8_t error_code =
+          (_op != 's' && _op != 'r' && _op != 'c') ? 0x01
+          : (_size > init_script::kMaxSize)        ? 0x02
+                                                   : 0x00;
+      if (error_code) {
+        send_error_response(error_code);
+        return true;
+      }
+
+      if (_op == 'r') {
+        uint16_t n = 0;
+        const uint8_t* script = init_script::get(&n);
+        transport::write('K');
+        transport::write(n >> 8);    // Count MSB
+        transport::write(n & 0xff);  // Count LSB
+        if (script) {
+          transport::write(script, n);
+        }
+        return true;
+      }
+      if (_op == 'c') {
+        init_script::clear();
+        transport::write('K');
+        return true;
+      }
+      init_script::begin_store();
+    }
+
+    // Store. Read the script in chunks.
+    while (_bytes_done < _size) {
+      const uint16_t n =
+          std::min((uint16_t)(_size - _bytes_done), (uint16_t)sizeof(data_buffer));
+      if (!read_serial_bytes(n)) {
+        return false;
+      }
+      // Can't fail since we checked the size, but if it does, we still
+      // consume the rest of the script to stay in sync with the host.
+      if (!init_script::append(data_buffer, n)) {
+        _append_failed = true;
+      }
+      data_size = 0;
+      _bytes_done += n;
+    }
+    if (_append_failed) {
+      send_error_response(0x02);
+      return true;
+    }
+    if (!init_script::end_store()) {
+      send_error_response(0x03);
+      return true;
+    }
+    transport::write('K');
+    return true;
+  }
+
+ private:
+  bool _got_cmd_header = false;
+  uint8_t _op;
+  uint16_t _size;
+  uint16_t _bytes_done;
+  bool _append_failed;
+
+  void reset() {
+    _got_cmd_header = false;
+    _op = 0;
+    _size = 0;
+    _bytes_done = 0;
+    _append_failed = false;
+  }
+
+} init_script_cmd_handler;
+
+static CommandHandler* find_command_handler_by_char(const char cmd_char);
+
+// HELLO command. Starts a host session and returns the adapter's identity
+// and capabilities, so the host can connect with a single round trip.
+// Resets the session state of the channel, releasing a held CS and
+// stopping the aux pins notifications, if they are sent to this channel.
+//
+// The host picks random nonce bytes that are not letters, for example
+// in the range 0x80-0xff, so older firmware ignores them as unknown
+// commands, and finds the response by its nonce, skipping any stale
+// bytes of responses to a previous session.
+//
+// Command:
+// - byte 0:    'h'
+// - byte 1-4:  Nonce.
+//
+// Response:
+// - byte 0:    'K' for OK.
+// - byte 1-4:  The nonce from the command.
+// - byte 5:    'S'
+// - byte 6:    'P'
+// - byte 7:    'I'
+// - byte 8:    Version of wire format API.
+// - byte 9:    MSB of firmware version.
+// - byte 10:   LSB of firmware version.
+// - byte 11-14: Supported commands. Bit i is set if the command with
+//               selector 'a' + i is supported. Big endian.
+static class HelloCommandHandler : public CommandHandler {
+ public:
+  HelloCommandHandler() : CommandHandler("HELLO") {}
+
+  virtual bool on_cmd_loop() override {
+    static_assert(sizeof(data_buffer) >= 4);
+    if (!read_serial_bytes(4)) {
+      return false;
+    }
+
+    // Reset the session state.
+    release_held_cs();
+    if (aux_events_channel == transport::selected_channel()) {
+      aux_events::subscribe(0);
+    }
+
+    uint32_t commands_mask = 0;
+    for (uint8_t i = 0; i < 26; i++) {
+      if (find_command_handler_by_char('a' + i)) {
+        commands_mask |= 1ul << i;
+      }
+    }
+
+    transport::write('K');
+    transport::write(data_buffer, 4);
+    transport::write('S');
+    transport::write('P');
+    transport::write('I');
+    transport::write(kApiVersion);
+    transport::write(kFirmwareVersion >> 8);
+    transport::write(kFirmwareVersion & 0xff);
+    write_uint32(commands_mask);
+    return true;
+  }
+
+} hello_cmd_handler;
+
+// Given a command char, return a Command pointer or null if invalid command
+// char.
+static CommandHandler* TIME_CRITICAL(find_command_handler_by_char)(
+    const char cmd_char) {
+  switch (cmd_char) {
+    case 'e':
+      return &echo_cmd_handler;
+    case 'i':
+      return &info_cmd_handler;
+    case 'g':
+      return &extended_info_cmd_handler;
+    case 'm':
+      return &aux_mode_cmd_handler;
+    case 'a':
+      return &aux_pins_read_cmd_handler;
+    case 'b':
+      return &aux_pins_write_cmd_handler;
+    case 's':
+      return &send_cmd_handler;
+    case 'w':
+      return &aux_waveform_cmd_handler;
+    case 'c':
+      return &aux_capture_cmd_handler;
+    case 'n':
+      return &aux_notify_cmd_handler;
+    case 't':
+      return &cs_timing_cmd_handler;
+    case 'd':
+      return &daisy_chain_cmd_handler;
+    case 'q':
+      return &qspi_cmd_handler;
+    case 'f':
+      return &flash_cmd_handler;
+    case 'p':
+      return &poll_cmd_handler;
+    case 'r':
+      return &crc_cmd_handler;
+    case 'v':
+      return &verify_cmd_handler;
+    case 'o':
+      return &display_cmd_handler;
+    case 'x':
+      return &stats_cmd_handler;
+    case 'l':
+      return &trace_cmd_handler;
+    case 'u':
+      return &init_script_cmd_handler;
+    case 'h':
+      return &hello_cmd_handler;
+    default:
+      return nullptr;
+  }
+}
+
+// Runs the init script, if any, through the command handlers, with their
+// responses discarded. See INIT SCRIPT command.
+static void run_init_script() {
+  uint16_t size;
+  const uint8_t* script = init_script::get(&size);
+  if (!script) {
+    return;
+  }
+  transport::begin_replay(script, size);
+  for (;;) {
+    data_size = 0;
+    if (!read_serial_bytes(1)) {
+      break;
+    }
+    const char cmd_char = data_buffer[0];
+    if (cmd_char != 's' && cmd_char != 'm' && cmd_char != 'b' &&
+        cmd_char != 't') {
+      break;
+    }
+    CommandHandler* const handler = find_command_handler_by_char(cmd_char);
+    data_size = 0;
+    cmd_trace = trace::Entry();
+    handler->on_cmd_entered();
+    // All the script bytes are available, so a command that is not
+    // completed by now is truncated.
+    bool completed;
+    while (!(completed = handler->on_cmd_loop()) && transport::available()) {
+    }
+    if (!completed) {
+      handler->on_cmd_aborted();
+      break;
+    }
+  }
+  transport::end_replay();
+  release_held_cs();
+}
+
+void setup() {
+  // A short delay to let the USB/CDC settle down. Otherwise
+  // it messes up with the debugger, in case it's used. Not needed
+  // otherwise, so it doesn't delay the host connection.
+#ifdef __PLATFORMIO_BUILD_DEBUG__
+  delay(500);
+#endif
+
+  board::setup();
+  timing::setup();
+  board::led.update(false);
+  last_led_state = false;
+
+  // USB serial.
+  transport::setup();
+
+  // Init CS outputs.
+  for (uint8_t i = 0; i < kNumCsPins; i++) {
+    auto gp_pin = cs_pins[i];
+    pinMode(gp_pin, OUTPUT);
+  }
+  all_cs_off();
+
+  // Init aux pins as inputs.
+  for (uint8_t i = 0; i < kNumAuxPins; i++) {
+    auto gp_pin = aux_pins[i];
+    pinMode(gp_pin, INPUT_PULLUP);
+  }
+  aux_waveform::setup(aux_pins[0]);
+  aux_capture::setup(aux_pins[0]);
+  aux_events::setup(aux_pins[0]);
+  qspi::setup(aux_pins[4], PIN_SPI_SCK);
+
+  // Initialize the SPI channel.
+  SPI.begin();
+  track_spi_clock_polarity(SPI_MODE0);
+  spi_hw::setup();
+
+  // Initialize the devices while the host enumerates the USB device.
+  run_init_script();
+}
+
+// If in command, points to the command handler.
+static CommandHandler* current_cmd = nullptr;
+
+// Completes the trace info of the current command and adds it to the
+// trace.
+static void TIME_CRITICAL(end_cmd_trace)() {
+  cmd_trace.duration_us = stats::now_us() - cmd_trace.start_us;
+  cmd_trace.bytes_out = transport::bytes_written() - cmd_bytes_written_start;
+  trace::add(cmd_trace);
+}
+
+void TIME_CRITICAL(loop)() {
+  transport::flush();
+  aux_waveform::loop();
+  const uint32_t millis_now = millis();
+  const uint32_t millis_since_cmd_start = cmd_timer.elapsed_millis(millis_now);
+
+  // Update LED state. Solid if active or short blinks if idle.
+  {
+    const bool is_active = current_cmd || millis_since_cmd_start < 200;
+    const bool new_led_state =
+        is_active || (millis_since_cmd_start & 0b11111111100) == 0;
+    if (new_led_state != last_led_state) {
+      led.update(new_led_state);
+      last_led_state = new_led_state;
+    }
+  }
+
+  // If a command is in progress, handle it.
+  if (current_cmd) {
+    // Handle command timeout.
+    if (millis_since_cmd_start > kCommandTimeoutMillis) {
+      current_cmd->on_cmd_aborted();
+      current_cmd = nullptr;
+      stats::add_timeout();
+      cmd_trace.status = trace::kStatusTimeout;
+      end_cmd_trace();
+      return;
+    }
+    // Invoke command loop.
+    const bool cmd_completed = current_cmd->on_cmd_loop();
+    if (cmd_completed) {
+      current_cmd = nullptr;
+      end_cmd_trace();
+      stats::add_phase(stats::kReceive,
+                       cmd_receive_end_us - cmd_trace.start_us);
+      stats::add_command(cmd_trace.selector, cmd_trace.duration_us,
+                         cmd_trace.status != trace::kStatusOk);
+    }
+    return;
+  }
+
+  // Not in a command. Turn off all CS outputs, except for a held CS, until
+  // it times out.
+  if (!is_cs_held ||
+      cs_hold_timer.elapsed_millis(millis_now) > kCsHoldTimeoutMillis) {
+    is_cs_held = false;
+    all_cs_off();
+  }
+
+  // Send pending aux events, if any, between command responses.
+  send_aux_events();
+
+  // Select the channel of the next command, round robin, so the channels
+  // share the SPI bus fairly, one command at a time.
+  const uint8_t channels_mask =
+      is_cs_held ? (1 << held_cs_channel) : (1 << transport::kNumChannels) - 1;
+  if (!transport::select_next_channel(channels_mask)) {
+    return;
+  }
 
   // Try to read selection char of next command.
   static_assert(sizeof(data_buffer) >= 1);
@@ -599,10 +3039,18 @@ void loop() {
   current_cmd = find_command_handler_by_char(data_buffer[0]);
   if (current_cmd) {
     cmd_timer.reset(millis_now);
+    cmd_trace = trace::Entry();
+    cmd_trace.start_us = stats::now_us();
+    cmd_trace.selector = data_buffer[0];
+    cmd_trace.bytes_in = 1;
+    cmd_trace.channel = transport::selected_channel();
+    cmd_receive_end_us = cmd_trace.start_us;
+    cmd_bytes_written_start = transport::bytes_written();
     data_size = 0;
     current_cmd->on_cmd_entered();
     // We call on_cmd_loop() on the next iteration, after updating the LED.
   } else {
     // Unknown command selector. We ignore it silently.
+    stats::add_unknown_command();
   }
 }
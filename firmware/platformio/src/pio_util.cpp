@@ -0,0 +1,37 @@
+// Implementation of pio_util.h
+
+#include "pio_util.h"
+
+#include "hardware/dma.h"
+
+namespace pio_util {
+
+bool allocate(const pio_program_t* program, PioResources* resources,
+              bool with_dma) {
+  if (resources->pio) {
+    return true;
+  }
+  const PIO candidates[] = {pio0, pio1};
+  for (PIO candidate : candidates) {
+    if (!pio_can_add_program(candidate, program)) {
+      continue;
+    }
+    const int claimed_sm = pio_claim_unused_sm(candidate, false);
+    if (claimed_sm < 0) {
+      continue;
+    }
+    const int dma_channel = with_dma ? dma_claim_unused_channel(false) : -1;
+    if (with_dma && dma_channel < 0) {
+      pio_sm_unclaim(candidate, claimed_sm);
+      return false;
+    }
+    resources->pio = candidate;
+    resources->sm = claimed_sm;
+    resources->program_offset = pio_add_program(candidate, program);
+    resources->dma_channel = dma_channel;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace pio_util
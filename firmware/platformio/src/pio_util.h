@@ -0,0 +1,24 @@
+// Helpers for sharing the PIO and DMA hardware between the firmware modules.
+
+#pragma once
+
+#include "hardware/pio.h"
+
+namespace pio_util {
+
+// Resources that are allocated for a single PIO program.
+struct PioResources {
+  // Null if not allocated.
+  PIO pio = nullptr;
+  uint sm = 0;
+  uint program_offset = 0;
+  int dma_channel = -1;
+};
+
+// Loads the program into one of the PIO blocks and claims a state machine
+// there and, if with_dma is true, a DMA channel. Does nothing if already
+// allocated. Returns false if the resources are not available.
+extern bool allocate(const pio_program_t* program, PioResources* resources,
+                     bool with_dma = true);
+
+}  // namespace pio_util
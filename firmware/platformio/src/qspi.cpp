@@ -0,0 +1,212 @@
+// Implementation of qspi.h
+
+#include "qspi.h"
+
+#include <Arduino.h>
+
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/pio_instructions.h"
+#include "pio_util.h"
+
+namespace qspi {
+
+// The PIO program. SCK is the side-set pin. Each transaction phase is
+// started by the CPU at one of the loops below, with x set to the number
+// of bit groups minus one, and it ends in the 'end' loop with SCK low.
+// Data is shifted MSB first, with autopull/autopush every 8 bits.
+//
+//  w1: out pins, 1  side 0   ; Write loops, data changes while SCK is low.
+//      jmp x-- w1   side 1
+//      jmp end      side 0
+//  w2: out pins, 2  side 0
+//      jmp x-- w2   side 1
+//      jmp end      side 0
+//  w4: out pins, 4  side 0
+//      jmp x-- w4   side 1
+//      jmp end      side 0
+//  r1: in pins, 1   side 1   ; Read loops, sample on SCK rising edge.
+//      jmp x-- r1   side 0
+//      jmp end      side 0
+//  r2: in pins, 2   side 1
+//      jmp x-- r2   side 0
+//      jmp end      side 0
+//  r4: in pins, 4   side 1
+//      jmp x-- r4   side 0
+//      jmp end      side 0
+//  d:  nop          side 1   ; Dummy cycles.
+//      jmp x-- d    side 0
+// end: jmp end      side 0
+static constexpr uint kWriteEntry = 0;
+static constexpr uint kReadEntry = 9;
+static constexpr uint kDummyEntry = 18;
+static constexpr uint kEndEntry = 20;
+static constexpr uint kProgramLength = 21;
+static uint16_t program_instructions[kProgramLength];
+static const pio_program_t program = {program_instructions, kProgramLength,
+                                      -1};
+
+// Allocated hardware resources.
+static pio_util::PioResources res;
+
+static uint8_t io0_pin = 0;
+static uint8_t sck_pin = 0;
+
+// Gpio masks of the data pins and of all the pins.
+static uint32_t data_pins_mask = 0;
+static uint32_t all_pins_mask = 0;
+
+// The gpio settings of the data pins before the transaction, as set by
+// the aux pins commands. Gpio masks.
+static uint32_t saved_out_levels = 0;
+static uint32_t saved_out_dirs = 0;
+static uint32_t saved_pull_ups = 0;
+static uint32_t saved_pull_downs = 0;
+
+// Returns the loop index of a data width of 1, 2 or 4 lines.
+static uint width_index(uint8_t width) {
+  return (width == 4) ? 2 : (width == 2) ? 1 : 0;
+}
+
+// With side-set of a single pin, the side value is at bit 12.
+static uint16_t side(uint instruction, bool sck) {
+  return instruction | (sck ? (1u << 12) : 0);
+}
+
+// Starts a phase at the given program entry with the given number of
+// iterations. The state machine is expected to be disabled.
+static void start_phase(uint entry, uint32_t iterations) {
+  pio_sm_restart(res.pio, res.sm);
+  pio_sm_clear_fifos(res.pio, res.sm);
+  pio_sm_put(res.pio, res.sm, iterations - 1);
+  pio_sm_exec(res.pio, res.sm, pio_encode_pull(false, false));
+  pio_sm_exec(res.pio, res.sm, pio_encode_out(pio_x, 32));
+  pio_sm_exec(res.pio, res.sm, pio_encode_jmp(res.program_offset + entry));
+  pio_sm_set_enabled(res.pio, res.sm, true);
+}
+
+// Waits for the current phase to complete and stops the state machine.
+static void end_phase() {
+  while (pio_sm_get_pc(res.pio, res.sm) != res.program_offset + kEndEntry) {
+  }
+  pio_sm_set_enabled(res.pio, res.sm, false);
+}
+
+void setup(uint8_t io0_gpio_pin, uint8_t sck_gpio_pin) {
+  io0_pin = io0_gpio_pin;
+  sck_pin = sck_gpio_pin;
+  data_pins_mask = 0b1111u << io0_pin;
+  all_pins_mask = data_pins_mask | (1u << sck_pin);
+
+  uint16_t* p = program_instructions;
+  // Write and read loops, for 1, 2 and 4 lines.
+  for (uint i = 0; i < 3; i++) {
+    const uint entry = kWriteEntry + 3 * i;
+    *p++ = side(pio_encode_out(pio_pins, 1 << i), false);
+    *p++ = side(pio_encode_jmp_x_dec(entry), true);
+    *p++ = side(pio_encode_jmp(kEndEntry), false);
+  }
+  for (uint i = 0; i < 3; i++) {
+    const uint entry = kReadEntry + 3 * i;
+    *p++ = side(pio_encode_in(pio_pins, 1 << i), true);
+    *p++ = side(pio_encode_jmp_x_dec(entry), false);
+    *p++ = side(pio_encode_jmp(kEndEntry), false);
+  }
+  // Dummy cycles and the end loop.
+  *p++ = side(pio_encode_nop(), true);
+  *p++ = side(pio_encode_jmp_x_dec(kDummyEntry), false);
+  *p++ = side(pio_encode_jmp(kEndEntry), false);
+}
+
+bool begin_transaction(uint32_t frequency_hz) {
+  if (!pio_util::allocate(&program, &res, false)) {
+    return false;
+  }
+  pio_sm_config c = pio_get_default_sm_config();
+  sm_config_set_out_pins(&c, io0_pin, 4);
+  sm_config_set_in_pins(&c, io0_pin);
+  sm_config_set_sideset_pins(&c, sck_pin);
+  sm_config_set_sideset(&c, 1, false, false);
+  sm_config_set_out_shift(&c, false, true, 8);
+  sm_config_set_in_shift(&c, false, true, 8);
+  sm_config_set_clkdiv(&c, clock_get_hz(clk_sys) / (2.0f * frequency_hz));
+  pio_sm_init(res.pio, res.sm, res.program_offset + kEndEntry, &c);
+
+  // Save the data pins settings, to restore them in end_transaction().
+  saved_out_levels = 0;
+  saved_out_dirs = 0;
+  saved_pull_ups = 0;
+  saved_pull_downs = 0;
+  for (uint i = 0; i < 4; i++) {
+    const uint pin = io0_pin + i;
+    saved_out_levels |= gpio_get_out_level(pin) ? (1u << pin) : 0;
+    saved_out_dirs |= gpio_is_dir_out(pin) ? (1u << pin) : 0;
+    saved_pull_ups |= gpio_is_pulled_up(pin) ? (1u << pin) : 0;
+    saved_pull_downs |= gpio_is_pulled_down(pin) ? (1u << pin) : 0;
+  }
+
+  // SCK is an output, starting low. The data lines start as inputs and are
+  // pulled up so the WP and HOLD inputs of quad devices are inactive in
+  // the single line phases.
+  pio_sm_set_pins_with_mask(res.pio, res.sm, 0, all_pins_mask);
+  pio_sm_set_pindirs_with_mask(res.pio, res.sm, 1u << sck_pin, all_pins_mask);
+  for (uint i = 0; i < 4; i++) {
+    gpio_pull_up(io0_pin + i);
+    pio_gpio_init(res.pio, io0_pin + i);
+  }
+  pio_gpio_init(res.pio, sck_pin);
+  return true;
+}
+
+void end_transaction() {
+  pio_sm_set_enabled(res.pio, res.sm, false);
+  gpio_set_function(sck_pin, GPIO_FUNC_SPI);
+  // Set the levels and directions before switching the data pins back to
+  // gpio control, to avoid glitches on output pins.
+  gpio_put_masked(data_pins_mask, saved_out_levels);
+  gpio_set_dir_masked(data_pins_mask, saved_out_dirs);
+  for (uint i = 0; i < 4; i++) {
+    const uint pin = io0_pin + i;
+    gpio_set_pulls(pin, saved_pull_ups & (1u << pin),
+                   saved_pull_downs & (1u << pin));
+    gpio_set_function(pin, GPIO_FUNC_SIO);
+  }
+}
+
+void write(uint8_t width, const uint8_t* data, uint32_t n) {
+  if (!n) {
+    return;
+  }
+  const uint32_t width_mask = ((1u << width) - 1) << io0_pin;
+  pio_sm_set_pindirs_with_mask(res.pio, res.sm, width_mask, data_pins_mask);
+  start_phase(kWriteEntry + 3 * width_index(width), n * 8 / width);
+  for (uint32_t i = 0; i < n; i++) {
+    pio_sm_put_blocking(res.pio, res.sm, ((uint32_t)data[i]) << 24);
+  }
+  end_phase();
+}
+
+void read(uint8_t width, uint8_t* data, uint32_t n) {
+  if (!n) {
+    return;
+  }
+  pio_sm_set_pindirs_with_mask(res.pio, res.sm, 0, data_pins_mask);
+  pio_sm_set_in_pins(res.pio, res.sm, (width == 1) ? io0_pin + 1 : io0_pin);
+  start_phase(kReadEntry + 3 * width_index(width), n * 8 / width);
+  for (uint32_t i = 0; i < n; i++) {
+    data[i] = (uint8_t)pio_sm_get_blocking(res.pio, res.sm);
+  }
+  end_phase();
+}
+
+void dummy_cycles(uint32_t n) {
+  if (!n) {
+    return;
+  }
+  pio_sm_set_pindirs_with_mask(res.pio, res.sm, 0, data_pins_mask);
+  start_phase(kDummyEntry, n);
+  end_phase();
+}
+
+}  // namespace qspi
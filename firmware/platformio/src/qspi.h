@@ -0,0 +1,41 @@
+// Dual and quad SPI transactions using a PIO state machine. The data lines
+// IO0-IO3 are the consecutive aux pins 4-7 and the clock is the regular
+// SPI SCK pin which is borrowed from the SPI peripheral for the duration
+// of the transaction. CS is handled by the caller.
+//
+// Only SPI mode 0 is supported.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace qspi {
+
+// Max SCK frequency.
+static constexpr uint32_t kMaxFrequencyHz = 20000000;
+
+// Called once on startup. io0_gpio_pin is the first of the four
+// consecutive data gpio pins.
+extern void setup(uint8_t io0_gpio_pin, uint8_t sck_gpio_pin);
+
+// Takes over the data and clock pins. Returns false if the PIO resources
+// are not available.
+extern bool begin_transaction(uint32_t frequency_hz);
+
+// Returns the clock pin to the SPI peripheral and the data pins to
+// regular gpio control, with the direction, output level and pull
+// settings they had before begin_transaction().
+extern void end_transaction();
+
+// Writes bytes, MSB first, using 1, 2 or 4 data lines. In the 1 line
+// mode, the data is written on IO0.
+extern void write(uint8_t width, const uint8_t* data, uint32_t n);
+
+// Reads bytes, MSB first, using 1, 2 or 4 data lines. In the 1 line mode,
+// the data is read from IO1.
+extern void read(uint8_t width, uint8_t* data, uint32_t n);
+
+// Clocks the given number of SCK cycles with the data lines released.
+extern void dummy_cycles(uint32_t n);
+
+}  // namespace qspi
@@ -0,0 +1,144 @@
+// Implementation of spi_hw.h
+
+#include "spi_hw.h"
+
+#include "hardware/dma.h"
+#include "hardware/spi.h"
+
+namespace spi_hw {
+
+// The SPI pins GP16, GP18 and GP19 are of spi0.
+static spi_inst_t* const kSpi = spi0;
+
+static uint16_t frames[kMaxFrames];
+
+// DMA channels of read_crc().
+static uint tx_dma_channel;
+static uint rx_dma_channel;
+
+// Sniffer calculation modes.
+static constexpr uint kSniffCrc32Reversed = 0x1;
+static constexpr uint kSniffCrc16Ccitt = 0x2;
+
+void setup() {
+  tx_dma_channel = dma_claim_unused_channel(true);
+  rx_dma_channel = dma_claim_unused_channel(true);
+}
+
+uint8_t word_bytes(uint8_t word_bits) {
+  return (word_bits == kWordBits32)                               ? 4
+         : (word_bits < kMinWordBits || word_bits > kMaxFrameBits) ? 0
+         : (word_bits > 8)                                          ? 2
+                                                                    : 1;
+}
+
+// Reads a word of the given number of bytes.
+static uint32_t get_word(const uint8_t* p, uint8_t num_bytes,
+                         bool little_endian) {
+  uint32_t word = 0;
+  for (uint8_t i = 0; i < num_bytes; i++) {
+    const uint8_t b = little_endian ? p[num_bytes - 1 - i] : p[i];
+    word = (word << 8) | b;
+  }
+  return word;
+}
+
+// Writes a word of the given number of bytes.
+static void put_word(uint8_t* p, uint8_t num_bytes, bool little_endian,
+                     uint32_t word) {
+  for (uint8_t i = 0; i < num_bytes; i++) {
+    const uint8_t b = (uint8_t)(word >> (8 * (num_bytes - 1 - i)));
+    if (little_endian) {
+      p[num_bytes - 1 - i] = b;
+    } else {
+      p[i] = b;
+    }
+  }
+}
+
+void transfer_words(uint8_t word_bits, bool little_endian, uint8_t spi_mode,
+                    uint8_t* data, uint16_t n) {
+  const uint8_t num_bytes = word_bytes(word_bits);
+  const uint16_t num_words = n / num_bytes;
+  const bool is_32_bits = word_bits == kWordBits32;
+  const uint8_t frame_bits = is_32_bits ? 16 : word_bits;
+  const uint16_t frame_mask = (1u << frame_bits) - 1;
+
+  // Pack the words into frames.
+  uint16_t num_frames = 0;
+  for (uint16_t i = 0; i < num_words; i++) {
+    const uint32_t word =
+        get_word(&data[i * num_bytes], num_bytes, little_endian);
+    if (is_32_bits) {
+      frames[num_frames++] = word >> 16;
+    }
+    frames[num_frames++] = word & frame_mask;
+  }
+
+  // The Arduino SPI API always uses 8 bit frames so we restore it when
+  // done.
+  const spi_cpol_t cpol = (spi_mode & 0b10) ? SPI_CPOL_1 : SPI_CPOL_0;
+  const spi_cpha_t cpha = (spi_mode & 0b01) ? SPI_CPHA_1 : SPI_CPHA_0;
+  spi_set_format(kSpi, frame_bits, cpol, cpha, SPI_MSB_FIRST);
+  spi_write16_read16_blocking(kSpi, frames, frames, num_frames);
+  spi_set_format(kSpi, 8, cpol, cpha, SPI_MSB_FIRST);
+
+  // Unpack the read frames.
+  uint16_t frame_index = 0;
+  for (uint16_t i = 0; i < num_words; i++) {
+    uint32_t word = frames[frame_index++];
+    if (is_32_bits) {
+      word = (word << 16) | frames[frame_index++];
+    }
+    put_word(&data[i * num_bytes], num_bytes, little_endian, word);
+  }
+}
+
+uint32_t read_crc(CrcType crc_type, uint32_t n) {
+  // Source of the written bytes and destination of the read bytes.
+  static const uint8_t tx_byte = 0x00;
+  static uint8_t rx_byte;
+
+  if (!n) {
+    return (crc_type == kCrc32) ? 0 : 0xffff;
+  }
+
+  // The TX channel feeds the SPI with a constant byte.
+  dma_channel_config tc = dma_channel_get_default_config(tx_dma_channel);
+  channel_config_set_transfer_data_size(&tc, DMA_SIZE_8);
+  channel_config_set_read_increment(&tc, false);
+  channel_config_set_write_increment(&tc, false);
+  channel_config_set_dreq(&tc, spi_get_dreq(kSpi, true));
+  dma_channel_configure(tx_dma_channel, &tc, &spi_get_hw(kSpi)->dr, &tx_byte,
+                        n, false);
+
+  // The RX channel drains the SPI through the sniffer.
+  dma_channel_config rc = dma_channel_get_default_config(rx_dma_channel);
+  channel_config_set_transfer_data_size(&rc, DMA_SIZE_8);
+  channel_config_set_read_increment(&rc, false);
+  channel_config_set_write_increment(&rc, false);
+  channel_config_set_dreq(&rc, spi_get_dreq(kSpi, false));
+  channel_config_set_sniff_enable(&rc, true);
+  dma_channel_configure(rx_dma_channel, &rc, &rx_byte, &spi_get_hw(kSpi)->dr,
+                        n, false);
+
+  if (crc_type == kCrc32) {
+    dma_sniffer_enable(rx_dma_channel, kSniffCrc32Reversed, true);
+    hw_set_bits(&dma_hw->sniff_ctrl,
+                DMA_SNIFF_CTRL_OUT_REV_BITS | DMA_SNIFF_CTRL_OUT_INV_BITS);
+    dma_hw->sniff_data = 0xffffffff;
+  } else {
+    dma_sniffer_enable(rx_dma_channel, kSniffCrc16Ccitt, true);
+    dma_hw->sniff_data = 0xffff;
+  }
+
+  // Start both channels at once.
+  dma_start_channel_mask((1u << tx_dma_channel) | (1u << rx_dma_channel));
+  dma_channel_wait_for_finish_blocking(rx_dma_channel);
+
+  const uint32_t crc = dma_hw->sniff_data;
+  dma_sniffer_disable();
+  return (crc_type == kCrc32) ? crc : (crc & 0xffff);
+}
+
+}  // namespace spi_hw
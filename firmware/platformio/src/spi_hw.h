@@ -0,0 +1,49 @@
+// Direct access to the SPI peripheral, for transfers that the Arduino SPI
+// API doesn't support. Used within an Arduino SPI transaction, which
+// configures the pins, the clock and the mode.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace spi_hw {
+
+// Word sizes, in bits, that transfer_words() accepts. 32 bit words are
+// sent as two consecutive 16 bit frames.
+static constexpr uint8_t kMinWordBits = 4;
+static constexpr uint8_t kMaxFrameBits = 16;
+static constexpr uint8_t kWordBits32 = 32;
+
+// Max number of frames per transfer_words() call.
+static constexpr uint16_t kMaxFrames = 256;
+
+// CRC types of read_crc(). Numeric values match the wire protocol.
+enum CrcType : uint8_t {
+  // CRC-32 as in zlib and Ethernet. Reflected, seed and final xor of
+  // 0xffffffff.
+  kCrc32 = 0,
+  // CRC-16/CCITT-FALSE. Polynomial 0x1021, seed 0xffff, not reflected.
+  kCrc16 = 1,
+};
+
+// Called once on startup, after the SPI is initialized.
+extern void setup();
+
+// Returns the number of data bytes per word of the given size, or zero if
+// the word size is not supported.
+extern uint8_t word_bytes(uint8_t word_bits);
+
+// Transfers a stream of words, in place. data contains n bytes with
+// word_bytes(word_bits) bytes per word, big or little endian, with the
+// unused upper bits ignored on write and zeroed on read. The words are
+// sent MSB first with no gaps between them. spi_mode is per
+// arduino::SPIMode and should match the current SPI transaction.
+extern void transfer_words(uint8_t word_bits, bool little_endian,
+                           uint8_t spi_mode, uint8_t* data, uint16_t n);
+
+// Reads n bytes, while writing 0x00 bytes, and returns their CRC, without
+// storing them. Uses DMA, with the CRC computed by the DMA sniffer, so the
+// bytes are read at the full SPI speed.
+extern uint32_t read_crc(CrcType crc_type, uint32_t n);
+
+}  // namespace spi_hw
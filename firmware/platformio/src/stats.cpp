@@ -0,0 +1,72 @@
+// Implementation of stats.h
+
+#include "stats.h"
+
+#include "hardware/timer.h"
+#include "time_critical.h"
+
+namespace stats {
+
+static Summary phases[kNumPhases];
+static CommandStats commands[kNumSelectors];
+static uint32_t timeout_count = 0;
+static uint32_t unknown_command_count = 0;
+
+void TIME_CRITICAL(Summary::add)(uint32_t duration_us) {
+  if (!count || duration_us < min_us) {
+    min_us = duration_us;
+  }
+  if (duration_us > max_us) {
+    max_us = duration_us;
+  }
+  count++;
+  total_us += duration_us;
+}
+
+uint32_t TIME_CRITICAL(now_us)() { return time_us_32(); }
+
+void TIME_CRITICAL(add_phase)(Phase phase, uint32_t duration_us) {
+  phases[phase].add(duration_us);
+}
+
+void TIME_CRITICAL(add_command)(char selector, uint32_t duration_us,
+                                bool is_error) {
+  if (selector < 'a' || selector > 'z') {
+    return;
+  }
+  CommandStats& cmd_stats = commands[selector - 'a'];
+  cmd_stats.durations.add(duration_us);
+  if (is_error) {
+    cmd_stats.errors++;
+  }
+}
+
+void add_timeout() { timeout_count++; }
+
+void add_unknown_command() { unknown_command_count++; }
+
+const Summary& phase(Phase phase) { return phases[phase]; }
+
+const CommandStats* command(char selector) {
+  if (selector < 'a' || selector > 'z') {
+    return nullptr;
+  }
+  return &commands[selector - 'a'];
+}
+
+uint32_t timeouts() { return timeout_count; }
+
+uint32_t unknown_commands() { return unknown_command_count; }
+
+void reset() {
+  for (Summary& summary : phases) {
+    summary = Summary();
+  }
+  for (CommandStats& cmd_stats : commands) {
+    cmd_stats = CommandStats();
+  }
+  timeout_count = 0;
+  unknown_command_count = 0;
+}
+
+}  // namespace stats
@@ -0,0 +1,62 @@
+// Lightweight timing and error statistics of the command processing, to
+// find where the latency goes on a live system. All the times are in
+// usecs, from the 1Mhz system timer, since the Cortex-M0+ has no cycle
+// counter.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace stats {
+
+// The measured phases of the command processing.
+enum Phase : uint8_t {
+  // From the command selector to the last byte of the command payload.
+  kReceive = 0,
+  // SPI transactions, from CS assertion to CS release.
+  kSpi = 1,
+  // Passing response bytes to the USB serial.
+  kTransmit = 2,
+  kNumPhases = 3,
+};
+
+// Statistics of a set of durations.
+struct Summary {
+  uint32_t count = 0;
+  uint32_t min_us = 0;
+  uint32_t max_us = 0;
+  uint32_t total_us = 0;
+
+  void add(uint32_t duration_us);
+  uint32_t mean_us() const { return count ? total_us / count : 0; }
+};
+
+// Statistics of the commands with a given selector char.
+struct CommandStats {
+  // Durations, from the command selector to the command completion.
+  Summary durations;
+  // Number of commands that ended with an error response.
+  uint32_t errors = 0;
+};
+
+// Command selectors are lower case letters.
+static constexpr uint8_t kNumSelectors = 26;
+
+// Returns the current time for the phase measurements.
+extern uint32_t now_us();
+
+extern void add_phase(Phase phase, uint32_t duration_us);
+extern void add_command(char selector, uint32_t duration_us, bool is_error);
+extern void add_timeout();
+extern void add_unknown_command();
+
+extern const Summary& phase(Phase phase);
+// Returns null if the selector is not a lower case letter.
+extern const CommandStats* command(char selector);
+extern uint32_t timeouts();
+extern uint32_t unknown_commands();
+
+// Clears all the statistics.
+extern void reset();
+
+}  // namespace stats
@@ -0,0 +1,21 @@
+// Placement of the command hot path in RAM. The RP2040 executes from the
+// XIP flash through a 16KB cache, so cache misses on the command path add
+// latency jitter. Enabled by the SPI_ADAPTER_TIME_CRITICAL_RAM build flag,
+// see env:raspberry_pico_perf in platformio.ini.
+
+#pragma once
+
+// Wraps the name of a function definition, e.g.
+//   static void TIME_CRITICAL(foo)(int x) { ... }
+//
+// The RP2040 linker script copies the .time_critical.* sections to RAM on
+// startup. As with the SDK's __not_in_flash_func(), each function gets its
+// own section, since GCC rejects a section that mixes inline (COMDAT)
+// functions, such as class members defined in the class body, with
+// regular ones.
+#if SPI_ADAPTER_TIME_CRITICAL_RAM
+#define TIME_CRITICAL(name) \
+  __attribute__((section(".time_critical." #name))) name
+#else
+#define TIME_CRITICAL(name) name
+#endif
@@ -0,0 +1,43 @@
+// Implementation of timing.h
+
+#include "timing.h"
+
+#include <Arduino.h>
+
+#include "hardware/clocks.h"
+#include "hardware/timer.h"
+
+namespace timing {
+
+// Number of CPU cycles per iteration of the delay loop below.
+static constexpr uint32_t kCyclesPerLoop = 3;
+
+// CPU cycles per usec. Set by setup().
+static uint32_t cycles_per_us = 125;
+
+void setup() { cycles_per_us = clock_get_hz(clk_sys) / 1000000; }
+
+void busy_wait_ns(uint32_t ns) {
+  // Whole usecs, using the hardware timer.
+  if (ns >= 1000) {
+    busy_wait_us_32(ns / 1000);
+    ns %= 1000;
+  }
+
+  // The rest, using a cycle counted loop, rounded up.
+  uint32_t loops =
+      (ns * cycles_per_us + (1000 * kCyclesPerLoop - 1)) /
+      (1000 * kCyclesPerLoop);
+  if (!loops) {
+    return;
+  }
+  // 1 cycle for subs and 2 cycles for a taken bne.
+  asm volatile(
+      "1: subs %0, #1\n"
+      "   bne 1b\n"
+      : "+l"(loops)
+      :
+      : "cc");
+}
+
+}  // namespace timing
@@ -0,0 +1,16 @@
+// Short busy-wait delays with a nanosecond resolution.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace timing {
+
+// Called once on startup.
+extern void setup();
+
+// Busy-waits at least the given number of nanoseconds. Intended for
+// short delays, such as SPI device setup and hold times.
+extern void busy_wait_ns(uint32_t ns);
+
+}  // namespace timing
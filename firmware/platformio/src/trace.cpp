@@ -0,0 +1,34 @@
+// Implementation of trace.h
+
+#include "trace.h"
+
+#include "time_critical.h"
+
+namespace trace {
+
+static Entry entries[kNumEntries];
+// Index of the next entry to write.
+static uint16_t next_index = 0;
+static uint16_t num_entries = 0;
+
+void TIME_CRITICAL(add)(const Entry& entry) {
+  entries[next_index] = entry;
+  next_index = (next_index + 1) % kNumEntries;
+  if (num_entries < kNumEntries) {
+    num_entries++;
+  }
+}
+
+uint16_t size() { return num_entries; }
+
+const Entry& get(uint16_t index) {
+  return entries[(next_index + kNumEntries - num_entries + index) %
+                 kNumEntries];
+}
+
+void clear() {
+  next_index = 0;
+  num_entries = 0;
+}
+
+}  // namespace trace
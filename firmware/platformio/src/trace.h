@@ -0,0 +1,51 @@
+// A fixed size in-RAM trace of the recent commands. Cheap enough to be
+// always on, so the history is available when something goes wrong.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace trace {
+
+// Number of entries. Older entries are overwritten.
+static constexpr uint16_t kNumEntries = 256;
+
+// Status of a traced command.
+static constexpr uint8_t kStatusOk = 0x00;
+static constexpr uint8_t kStatusTimeout = 0xff;
+
+struct Entry {
+  // Command start time, in usecs since startup.
+  uint32_t start_us;
+  // Command duration, in usecs.
+  uint32_t duration_us;
+  // Number of command bytes received, including the selector.
+  uint32_t bytes_in;
+  // Number of response bytes sent.
+  uint32_t bytes_out;
+  // The command selector char.
+  char selector;
+  // kStatusOk, the error code of an error response, or kStatusTimeout.
+  uint8_t status;
+  // The CS outputs, SPI mode and speed in 25Khz units of the last SPI
+  // transaction of the command. All zero if none.
+  uint8_t cs_mask;
+  uint8_t spi_mode;
+  uint8_t speed_units;
+  // The transport channel of the command.
+  uint8_t channel;
+};
+
+// Appends an entry.
+extern void add(const Entry& entry);
+
+// Returns the number of entries, up to kNumEntries.
+extern uint16_t size();
+
+// Returns the entry at the given index, with 0 for the oldest one.
+extern const Entry& get(uint16_t index);
+
+// Clears the trace.
+extern void clear();
+
+}  // namespace trace
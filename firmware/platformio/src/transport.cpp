@@ -0,0 +1,170 @@
+// Implementation of transport.h
+
+#include "transport.h"
+
+#include <Arduino.h>
+
+#include "stats.h"
+#include "time_critical.h"
+
+#if SPI_ADAPTER_NUM_CHANNELS > 1
+#include "USB/PluggableUSBSerial.h"
+#endif
+
+namespace transport {
+
+// The serial ports of the channels. Channel 0 is the regular USB serial.
+#if SPI_ADAPTER_NUM_CHANNELS > 1
+static arduino::USBSerial serial1(false);
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 2
+static arduino::USBSerial serial2(false);
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 3
+static arduino::USBSerial serial3(false);
+#endif
+
+static Stream* const channels[] = {
+    &Serial,
+#if SPI_ADAPTER_NUM_CHANNELS > 1
+    &serial1,
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 2
+    &serial2,
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 3
+    &serial3,
+#endif
+};
+static_assert(sizeof(channels) / sizeof(*channels) == kNumChannels);
+
+static uint8_t current_channel = 0;
+static Stream* current_stream = channels[0];
+
+// Bytes that are queued for sending on the selected channel.
+static uint8_t tx_buffer[kPacketSize];
+static uint16_t tx_size = 0;
+
+static uint32_t total_bytes_written = 0;
+
+// The script that is replayed, if replaying. See begin_replay().
+static bool is_replaying = false;
+static const uint8_t* replay_data = nullptr;
+static uint16_t replay_bytes_left = 0;
+
+// Passes bytes to the selected serial port.
+static void TIME_CRITICAL(send)(const uint8_t* data, size_t n) {
+  if (is_replaying) {
+    return;
+  }
+  const uint32_t start_us = stats::now_us();
+  current_stream->write(data, n);
+  stats::add_phase(stats::kTransmit, stats::now_us() - start_us);
+}
+
+void setup() {
+  Serial.begin(115200);
+#if SPI_ADAPTER_NUM_CHANNELS > 1
+  serial1.begin(115200);
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 2
+  serial2.begin(115200);
+#endif
+#if SPI_ADAPTER_NUM_CHANNELS > 3
+  serial3.begin(115200);
+#endif
+}
+
+uint8_t selected_channel() { return current_channel; }
+
+void select_channel(uint8_t channel) {
+  if (channel == current_channel || channel >= kNumChannels) {
+    return;
+  }
+  flush();
+  current_channel = channel;
+  current_stream = channels[channel];
+}
+
+bool TIME_CRITICAL(select_next_channel)(uint8_t channels_mask) {
+  for (uint8_t i = 1; i <= kNumChannels; i++) {
+    const uint8_t channel = (current_channel + i) % kNumChannels;
+    if ((channels_mask & (1 << channel)) && channels[channel]->available()) {
+      select_channel(channel);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint16_t TIME_CRITICAL(available)() {
+  return is_replaying ? replay_bytes_left : current_stream->available();
+}
+
+uint16_t TIME_CRITICAL(read)(uint8_t* bfr, uint16_t n) {
+  if (is_replaying) {
+    n = std::min(n, replay_bytes_left);
+    memcpy(bfr, replay_data, n);
+    replay_data += n;
+    replay_bytes_left -= n;
+    return n;
+  }
+  return current_stream->readBytes((char*)bfr, n);
+}
+
+void TIME_CRITICAL(write)(uint8_t b) {
+  total_bytes_written++;
+  tx_buffer[tx_size++] = b;
+  if (tx_size >= kPacketSize) {
+    flush();
+  }
+}
+
+void TIME_CRITICAL(write)(const uint8_t* data, size_t n) {
+  // Top up the pending packet first.
+  while (n && tx_size) {
+    write(*data++);
+    n--;
+  }
+  if (!n) {
+    return;
+  }
+  // Here the queue is empty. Send full packets directly from the data and
+  // queue the rest.
+  total_bytes_written += n;
+  const size_t direct_size = n - (n % kPacketSize);
+  if (direct_size) {
+    send(data, direct_size);
+    data += direct_size;
+    n -= direct_size;
+  }
+  memcpy(tx_buffer, data, n);
+  tx_size = n;
+}
+
+uint32_t bytes_written() { return total_bytes_written; }
+
+void TIME_CRITICAL(flush)() {
+  if (tx_size) {
+    send(tx_buffer, tx_size);
+    tx_size = 0;
+  }
+  if (!is_replaying) {
+    current_stream->flush();
+  }
+}
+
+void begin_replay(const uint8_t* data, uint16_t n) {
+  flush();
+  is_replaying = true;
+  replay_data = data;
+  replay_bytes_left = n;
+}
+
+void end_replay() {
+  flush();
+  is_replaying = false;
+  replay_bytes_left = 0;
+}
+
+}  // namespace transport
@@ -0,0 +1,72 @@
+// The host transport. Wraps the USB serial ports and batches the response
+// bytes into full USB packets, rather than sending a USB transfer per
+// write call.
+//
+// The host can use several channels, each is a separate USB serial port
+// with its own command stream, so independent host processes can use
+// different devices at the same time. Reads and writes apply to the
+// selected channel.
+//
+// Only CDC serial ports are supported. A vendor class bulk interface,
+// which would avoid the CDC overhead, is not implemented. The mbed USB
+// stack of the core has no vendor class, so it would need a custom
+// pluggable USB module, or a TinyUSB based core, and a libusb backend in
+// the host driver.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of channels. Set with a build flag. Additional channels are
+// additional CDC interfaces of the composite USB device.
+#ifndef SPI_ADAPTER_NUM_CHANNELS
+#define SPI_ADAPTER_NUM_CHANNELS 1
+#endif
+
+namespace transport {
+
+static constexpr uint8_t kNumChannels = SPI_ADAPTER_NUM_CHANNELS;
+static_assert(kNumChannels >= 1 && kNumChannels <= 4);
+
+// Size of the USB full speed bulk packets.
+static constexpr uint16_t kPacketSize = 64;
+
+// Called once on startup.
+extern void setup();
+
+// Returns the index of the selected channel.
+extern uint8_t selected_channel();
+
+// Selects a channel. Flushes the previous channel if it's a different one.
+extern void select_channel(uint8_t channel);
+
+// Selects the next channel, in a round robin order, that is included in
+// channels_mask and has received bytes. Returns false if there is no such
+// channel, in which case the selection is not changed.
+extern bool select_next_channel(uint8_t channels_mask);
+
+// Returns the number of received bytes that are available for reading.
+extern uint16_t available();
+
+// Reads up to n available bytes. Returns the number of bytes read.
+extern uint16_t read(uint8_t* bfr, uint16_t n);
+
+// Queues bytes for sending. Full packets are sent as they fill up.
+extern void write(uint8_t b);
+extern void write(const uint8_t* data, size_t n);
+
+// Returns the total number of bytes written since startup. Wraps around.
+extern uint32_t bytes_written();
+
+// Sends the queued bytes, if any. Called from the main loop, after the
+// commands output their responses.
+extern void flush();
+
+// Replaces the input with the given command script until end_replay(),
+// and discards the output. Used to run the init script on startup, see
+// init_script.h.
+extern void begin_replay(const uint8_t* data, uint16_t n);
+extern void end_replay();
+
+}  // namespace transport
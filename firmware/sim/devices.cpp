@@ -0,0 +1,514 @@
+// Implementation of devices.h
+
+#include "devices.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace devices {
+
+// ----- DeviceModel
+
+void DeviceModel::on_select(bool selected) {
+  if (selected) {
+    _byte_index = 0;
+    _transactions++;
+    on_begin();
+  } else {
+    on_end();
+  }
+}
+
+uint8_t DeviceModel::transfer(uint8_t mosi) {
+  // The CS is asserted before the SPI settings are applied, so we check
+  // the mode on the first byte rather than on select.
+  if (_byte_index == 0 &&
+      !(_spi_modes_mask & (1 << sim::spi_settings().data_mode))) {
+    _mode_errors++;
+  }
+  _bytes++;
+  return on_byte(_byte_index++, mosi);
+}
+
+void DeviceModel::print_summary(FILE* f) const {
+  fprintf(f, "%s: transactions=%llu, bytes=%llu, mode_errors=%llu\n", _name,
+          (unsigned long long)_transactions, (unsigned long long)_bytes,
+          (unsigned long long)_mode_errors);
+  print_state(f);
+}
+
+// ----- Ads1118
+
+Ads1118::Ads1118() : DeviceModel("ADS1118", 1 << 1) {}
+
+void Ads1118::on_begin() { _new_config = 0; }
+
+uint8_t Ads1118::on_byte(uint32_t byte_index, uint8_t mosi) {
+  switch (byte_index) {
+    case 0:
+      _new_config = (uint16_t)mosi << 8;
+      return (uint8_t)(_conversion >> 8);
+    case 1:
+      _new_config |= mosi;
+      // The config is updated only if the NOP bits are 01.
+      if ((_new_config & 0x0006) == 0x0002) {
+        _config = (_new_config & ~0x8000) | 0x0001;
+        // In single shot mode, SS starts a conversion. In continuous mode
+        // we convert on each transaction.
+        if ((_new_config & 0x8000) || !(_config & 0x0100)) {
+          convert();
+        }
+      }
+      return (uint8_t)_conversion;
+    case 2:
+      return (uint8_t)(_config >> 8);
+    case 3:
+      return (uint8_t)_config;
+    default:
+      return 0xff;
+  }
+}
+
+void Ads1118::convert() {
+  _conversions++;
+  // Internal temperature sensor, 14 bits left justified, 0.03125C/LSB.
+  if (_config & 0x0010) {
+    _conversion = (int16_t)((25.0 / 0.03125)) << 2;
+    return;
+  }
+  // Positive and negative inputs per MUX value. -1 is GND.
+  static constexpr int8_t kMux[8][2] = {{0, 1},  {0, 3},  {1, 3},  {2, 3},
+                                        {0, -1}, {1, -1}, {2, -1}, {3, -1}};
+  static constexpr int32_t kFullScaleMv[8] = {6144, 4096, 2048, 1024,
+                                              512,  256,  256,  256};
+  const int8_t* const mux = kMux[(_config >> 12) & 0x07];
+  const int32_t fs_mv = kFullScaleMv[(_config >> 9) & 0x07];
+  const int32_t mv = _inputs_mv[mux[0]] - (mux[1] < 0 ? 0 : _inputs_mv[mux[1]]);
+  const int64_t value = ((int64_t)mv * 32768) / fs_mv;
+  _conversion = (int16_t)(value < -32768 ? -32768
+                          : value > 32767 ? 32767
+                                          : value);
+}
+
+void Ads1118::print_state(FILE* f) const {
+  fprintf(f, "  config=0x%04x, conversions=%llu, last_result=%d\n", _config,
+          (unsigned long long)_conversions, _conversion);
+}
+
+// ----- Ad9833
+
+Ad9833::Ad9833() : DeviceModel("AD9833", 1 << 2) {}
+
+void Ad9833::on_begin() { _word_msb = 0; }
+
+uint8_t Ad9833::on_byte(uint32_t byte_index, uint8_t mosi) {
+  // Words are latched on their 16th bit, a partial word is dropped when
+  // FSYNC is released.
+  if (byte_index & 1) {
+    on_word(((uint16_t)_word_msb << 8) | mosi);
+  } else {
+    _word_msb = mosi;
+  }
+  // No MISO output.
+  return 0xff;
+}
+
+void Ad9833::on_word(uint16_t word) {
+  _words++;
+  const uint8_t reg_type = word >> 14;
+  if (reg_type == 0) {
+    _control = word & 0x3fff;
+    return;
+  }
+  if (reg_type == 3) {
+    // Phase register, selected by bit 13.
+    _phase_regs[(word >> 13) & 1] = word & 0x0fff;
+    return;
+  }
+  // Frequency register, 28 bits written as two 14 bits halves.
+  const uint8_t r = reg_type - 1;
+  const uint32_t half = word & 0x3fff;
+  bool msb;
+  if (_control & (1 << 13)) {
+    // B28, consecutive LSB and MSB writes.
+    msb = _b28_msb_next[r];
+    _b28_msb_next[r] = !msb;
+  } else {
+    // HLB selects the half.
+    msb = _control & (1 << 12);
+  }
+  _freq_regs[r] = msb ? ((_freq_regs[r] & 0x3fff) | (half << 14))
+                      : ((_freq_regs[r] & ~0x3fffu) | half);
+}
+
+double Ad9833::output_frequency_hz() const {
+  if (_control & (1 << 8)) {
+    return 0;
+  }
+  const uint32_t reg = _freq_regs[(_control >> 11) & 1];
+  return reg * kMasterClockHz / (1 << 28);
+}
+
+void Ad9833::print_state(FILE* f) const {
+  fprintf(f,
+          "  control=0x%04x, freq0=%.3fHz, freq1=%.3fHz, output=%.3fHz, "
+          "words=%llu\n",
+          _control, _freq_regs[0] * kMasterClockHz / (1 << 28),
+          _freq_regs[1] * kMasterClockHz / (1 << 28), output_frequency_hz(),
+          (unsigned long long)_words);
+}
+
+// ----- Ssd1306
+
+Ssd1306::Ssd1306(uint8_t dc_gpio_pin)
+    : DeviceModel("SSD1306", (1 << 0) | (1 << 3)), _dc_gpio_pin(dc_gpio_pin) {}
+
+uint8_t Ssd1306::on_byte(uint32_t byte_index, uint8_t mosi) {
+  (void)byte_index;
+  if (sim::pin_level(_dc_gpio_pin)) {
+    on_data_byte(mosi);
+  } else {
+    on_command_byte(mosi);
+  }
+  // No MISO output.
+  return 0xff;
+}
+
+// Returns the number of argument bytes of a command.
+static uint8_t ssd1306_args(uint8_t cmd) {
+  switch (cmd) {
+    case 0x20:  // Memory addressing mode.
+    case 0x81:  // Contrast.
+    case 0x8d:  // Charge pump.
+    case 0xa8:  // Multiplex ratio.
+    case 0xd3:  // Display offset.
+    case 0xd5:  // Clock divide.
+    case 0xd9:  // Pre-charge period.
+    case 0xda:  // COM pins.
+    case 0xdb:  // VCOMH level.
+      return 1;
+    case 0x21:  // Column address.
+    case 0x22:  // Page address.
+    case 0xa3:  // Vertical scroll area.
+      return 2;
+    case 0x29:  // Vertical and horizontal scroll.
+    case 0x2a:
+      return 5;
+    case 0x26:  // Horizontal scroll.
+    case 0x27:
+      return 6;
+    default:
+      return 0;
+  }
+}
+
+void Ssd1306::on_command_byte(uint8_t b) {
+  _cmd[_cmd_size++] = b;
+  if (_cmd_size <= ssd1306_args(_cmd[0])) {
+    return;
+  }
+  _cmd_size = 0;
+  _commands++;
+  const uint8_t cmd = _cmd[0];
+  if (cmd <= 0x0f) {
+    _column = (_column & 0xf0) | cmd;
+  } else if (cmd <= 0x1f) {
+    _column = ((cmd & 0x07) << 4) | (_column & 0x0f);
+  } else if (cmd == 0x20) {
+    _addressing_mode = _cmd[1] & 0x03;
+  } else if (cmd == 0x21) {
+    _column_start = _column = _cmd[1] & 0x7f;
+    _column_end = _cmd[2] & 0x7f;
+  } else if (cmd == 0x22) {
+    _page_start = _page = _cmd[1] & 0x07;
+    _page_end = _cmd[2] & 0x07;
+  } else if (cmd >= 0xb0 && cmd <= 0xb7) {
+    _page = cmd & 0x07;
+  } else if (cmd == 0xae || cmd == 0xaf) {
+    _display_on = cmd & 1;
+  }
+}
+
+void Ssd1306::on_data_byte(uint8_t b) {
+  _data_bytes++;
+  _ram[_page][_column] = b;
+  switch (_addressing_mode) {
+    case 0:  // Horizontal.
+      if (_column++ >= _column_end) {
+        _column = _column_start;
+        _page = (_page >= _page_end) ? _page_start : _page + 1;
+      }
+      break;
+    case 1:  // Vertical.
+      if (_page++ >= _page_end) {
+        _page = _page_start;
+        _column = (_column >= _column_end) ? _column_start : _column + 1;
+      }
+      break;
+    default:  // Page.
+      _column = (_column + 1) & 0x7f;
+      break;
+  }
+}
+
+void Ssd1306::print_state(FILE* f) const {
+  uint32_t lit_pixels = 0;
+  for (uint8_t page = 0; page < kPages; page++) {
+    for (uint8_t col = 0; col < kColumns; col++) {
+      lit_pixels += __builtin_popcount(_ram[page][col]);
+    }
+  }
+  fprintf(f,
+          "  display_on=%d, addressing_mode=%u, commands=%llu, "
+          "data_bytes=%llu, lit_pixels=%u\n",
+          _display_on, _addressing_mode, (unsigned long long)_commands,
+          (unsigned long long)_data_bytes, lit_pixels);
+}
+
+// ----- NorFlash
+
+NorFlash::NorFlash(uint32_t size_bytes, const uint8_t jedec_id[3])
+    : DeviceModel("NOR flash", (1 << 0) | (1 << 3)),
+      _size_bytes(size_bytes),
+      _memory(new uint8_t[size_bytes]) {
+  memcpy(_jedec_id, jedec_id, sizeof(_jedec_id));
+  memset(_memory, 0xff, _size_bytes);
+}
+
+NorFlash::~NorFlash() { delete[] _memory; }
+
+// Returns the number of address bytes of the current opcode, or zero if
+// it has no address.
+uint8_t NorFlash::addr_size() const {
+  switch (_opcode) {
+    case 0x03:  // Read.
+    case 0x0b:  // Fast read.
+    case 0x02:  // Page program.
+    case 0x20:  // 4KB sector erase.
+    case 0x52:  // 32KB block erase.
+    case 0xd8:  // 64KB block erase.
+      return _four_bytes_addr ? 4 : 3;
+    case 0x13:  // 4 bytes address variants of the above.
+    case 0x0c:
+    case 0x12:
+    case 0x21:
+    case 0x5c:
+    case 0xdc:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+void NorFlash::on_begin() {
+  _opcode = 0;
+  _addr = 0;
+  _addr_bytes = 0;
+}
+
+uint8_t NorFlash::on_byte(uint32_t byte_index, uint8_t mosi) {
+  if (byte_index == 0) {
+    _opcode = mosi;
+    // While busy, only the status register can be read.
+    if (_busy_status_reads && _opcode != 0x05) {
+      _rejected++;
+      _opcode = 0;
+    }
+    return 0xff;
+  }
+
+  if (_opcode == 0x05) {
+    return (_busy_status_reads ? 0x01 : 0x00) | (_write_enabled ? 0x02 : 0x00);
+  }
+  if (_opcode == 0x9f) {
+    return (byte_index <= 3) ? _jedec_id[byte_index - 1] : 0xff;
+  }
+
+  const uint8_t n = addr_size();
+  if (_addr_bytes < n) {
+    _addr = (_addr << 8) | mosi;
+    _addr_bytes++;
+    return 0xff;
+  }
+
+  switch (_opcode) {
+    case 0x0b:
+    case 0x0c:
+      // A dummy byte follows the address.
+      if (byte_index == 1u + n) {
+        return 0xff;
+      }
+      [[fallthrough]];
+    case 0x03:
+    case 0x13: {
+      const uint8_t b = _memory[_addr % _size_bytes];
+      _addr++;
+      _bytes_read++;
+      return b;
+    }
+    case 0x02:
+    case 0x12:
+      // Programming wraps around within the page and can only clear bits.
+      if (_write_enabled) {
+        const uint32_t page_base = (_addr % _size_bytes) & ~0xffu;
+        const uint32_t offset = (_addr + (byte_index - 1 - n)) & 0xff;
+        _memory[page_base + offset] &= mosi;
+        _bytes_programmed++;
+      }
+      return 0xff;
+    default:
+      return 0xff;
+  }
+}
+
+void NorFlash::on_end() {
+  const bool has_addr = addr_size() && _addr_bytes == addr_size();
+  switch (_opcode) {
+    case 0x06:
+      _write_enabled = true;
+      return;
+    case 0x04:
+      _write_enabled = false;
+      return;
+    case 0xb7:
+      _four_bytes_addr = true;
+      return;
+    case 0xe9:
+      _four_bytes_addr = false;
+      return;
+    case 0x02:
+    case 0x12:
+      break;
+    case 0x20:
+    case 0x21:
+      if (has_addr) erase(_addr, 4 * 1024);
+      break;
+    case 0x52:
+    case 0x5c:
+      if (has_addr) erase(_addr, 32 * 1024);
+      break;
+    case 0xd8:
+    case 0xdc:
+      if (has_addr) erase(_addr, 64 * 1024);
+      break;
+    case 0xc7:
+    case 0x60:
+      erase(0, _size_bytes);
+      break;
+    case 0x05:
+      if (_busy_status_reads) {
+        _busy_status_reads--;
+      }
+      return;
+    default:
+      return;
+  }
+  // A program or erase. Requires a preceding write enable.
+  if (!_write_enabled) {
+    _rejected++;
+    return;
+  }
+  _write_enabled = false;
+  _busy_status_reads = kBusyStatusReads;
+}
+
+void NorFlash::erase(uint32_t addr, uint32_t n) {
+  if (!_write_enabled) {
+    return;
+  }
+  _erases++;
+  const uint32_t base = (addr % _size_bytes) & ~(n - 1);
+  memset(&_memory[base], 0xff, std::min(n, _size_bytes - base));
+}
+
+void NorFlash::print_state(FILE* f) const {
+  fprintf(f,
+          "  size=%uKB, bytes_read=%llu, bytes_programmed=%llu, erases=%llu, "
+          "rejected=%llu\n",
+          _size_bytes / 1024, (unsigned long long)_bytes_read,
+          (unsigned long long)_bytes_programmed, (unsigned long long)_erases,
+          (unsigned long long)_rejected);
+}
+
+// ----- Factory
+
+// Parses the next "key=value" pair of a spec. Returns false if none.
+static bool next_option(const char** p, char* key, size_t key_size,
+                        long* value) {
+  if (!**p) {
+    return false;
+  }
+  const char* eq = strchr(*p, '=');
+  if (!eq || (size_t)(eq - *p) >= key_size) {
+    *value = -1;
+    key[0] = 0;
+    *p += strlen(*p);
+    return true;
+  }
+  memcpy(key, *p, eq - *p);
+  key[eq - *p] = 0;
+  char* end;
+  *value = strtol(eq + 1, &end, 0);
+  if (end == eq + 1 || (*end && *end != ',')) {
+    key[0] = 0;
+  }
+  *p = *end ? end + 1 : end;
+  return true;
+}
+
+DeviceModel* create(const char* spec) {
+  const char* colon = strchr(spec, ':');
+  const size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+  const char* options = colon ? colon + 1 : "";
+  char key[16];
+  long value;
+
+  if (!strncmp(spec, "ads1118", name_len) && name_len == 7) {
+    Ads1118* device = new Ads1118();
+    while (next_option(&options, key, sizeof(key), &value)) {
+      if (strncmp(key, "ain", 3) || key[3] < '0' || key[3] > '3' || key[4]) {
+        delete device;
+        return nullptr;
+      }
+      device->set_input_mv(key[3] - '0', value);
+    }
+    return device;
+  }
+
+  if (!strncmp(spec, "ad9833", name_len) && name_len == 6) {
+    return *options ? nullptr : new Ad9833();
+  }
+
+  if (!strncmp(spec, "ssd1306", name_len) && name_len == 7) {
+    long dc_aux_pin = -1;
+    while (next_option(&options, key, sizeof(key), &value)) {
+      if (strcmp(key, "dc") || value < 0 || value > 7) {
+        return nullptr;
+      }
+      dc_aux_pin = value;
+    }
+    // The aux pins are GP0 - GP7.
+    return (dc_aux_pin < 0) ? nullptr : new Ssd1306((uint8_t)dc_aux_pin);
+  }
+
+  if (!strncmp(spec, "flash", name_len) && name_len == 5) {
+    long size_kb = 16 * 1024;
+    while (next_option(&options, key, sizeof(key), &value)) {
+      if (strcmp(key, "size_kb") || value < 64 || value > 256 * 1024 ||
+          (value & (value - 1))) {
+        return nullptr;
+      }
+      size_kb = value;
+    }
+    // Winbond W25Q series ID, with the capacity byte per the size.
+    const uint8_t jedec_id[] = {0xef, 0x40,
+                                (uint8_t)(__builtin_ctzl(size_kb) + 10)};
+    return new NorFlash(size_kb * 1024, jedec_id);
+  }
+
+  return nullptr;
+}
+
+}  // namespace devices
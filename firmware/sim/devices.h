@@ -0,0 +1,183 @@
+// Simulated models of SPI devices, for testing the drivers and measuring
+// the end to end throughput without hardware. Each model is attached to a
+// CS output, see sim::attach_spi_device().
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sim.h"
+
+namespace devices {
+
+// Base of the device models. Counts the transactions and the transferred
+// bytes and checks the SPI mode of each transaction.
+class DeviceModel : public sim::SpiDevice {
+ public:
+  // spi_modes_mask has a bit for each SPI mode that the device supports.
+  DeviceModel(const char* name, uint8_t spi_modes_mask)
+      : _name(name), _spi_modes_mask(spi_modes_mask) {}
+
+  const char* name() const { return _name; }
+
+  virtual void on_select(bool selected) override;
+  virtual uint8_t transfer(uint8_t mosi) override;
+
+  // Prints the counters and the device specific state.
+  void print_summary(FILE* f) const;
+
+ protected:
+  // Called on the start and end of each transaction.
+  virtual void on_begin() {}
+  virtual void on_end() {}
+  // Called for each byte of a transaction. byte_index is relative to the
+  // start of the transaction.
+  virtual uint8_t on_byte(uint32_t byte_index, uint8_t mosi) = 0;
+  virtual void print_state(FILE* f) const = 0;
+
+ private:
+  const char* const _name;
+  const uint8_t _spi_modes_mask;
+  uint32_t _byte_index = 0;
+  uint64_t _transactions = 0;
+  uint64_t _bytes = 0;
+  uint64_t _mode_errors = 0;
+};
+
+// TI ADS1118 16 bit ADC. Each transaction writes the config register and
+// reads the last conversion result followed by the config register.
+// Conversions complete immediately, based on fixed input voltages.
+class Ads1118 : public DeviceModel {
+ public:
+  Ads1118();
+
+  // Sets the voltage of an input, in mV, relative to GND.
+  void set_input_mv(uint8_t ain, int32_t mv) { _inputs_mv[ain & 3] = mv; }
+
+ protected:
+  virtual void on_begin() override;
+  virtual uint8_t on_byte(uint32_t byte_index, uint8_t mosi) override;
+  virtual void print_state(FILE* f) const override;
+
+ private:
+  int32_t _inputs_mv[4] = {};
+  uint16_t _config = 0x058b;
+  uint16_t _new_config = 0;
+  int16_t _conversion = 0;
+  uint64_t _conversions = 0;
+
+  void convert();
+};
+
+// Analog Devices AD9833 DDS. Write only, with 16 bit words.
+class Ad9833 : public DeviceModel {
+ public:
+  Ad9833();
+
+  // Returns the current output frequency, or zero if in reset.
+  double output_frequency_hz() const;
+
+ protected:
+  virtual void on_begin() override;
+  virtual uint8_t on_byte(uint32_t byte_index, uint8_t mosi) override;
+  virtual void print_state(FILE* f) const override;
+
+ private:
+  static constexpr double kMasterClockHz = 25000000.0;
+
+  uint16_t _control = 0x0100;
+  uint32_t _freq_regs[2] = {};
+  uint16_t _phase_regs[2] = {};
+  // Set after the LSB half of a frequency register when B28 is set.
+  bool _b28_msb_next[2] = {};
+  uint8_t _word_msb = 0;
+  uint64_t _words = 0;
+
+  void on_word(uint16_t word);
+};
+
+// Solomon SSD1306 128x64 OLED controller. The DC input is read from the
+// given gpio pin on each byte.
+class Ssd1306 : public DeviceModel {
+ public:
+  explicit Ssd1306(uint8_t dc_gpio_pin);
+
+  const uint8_t* ram_page(uint8_t page) const { return _ram[page]; }
+
+ protected:
+  virtual uint8_t on_byte(uint32_t byte_index, uint8_t mosi) override;
+  virtual void print_state(FILE* f) const override;
+
+ private:
+  static constexpr uint8_t kColumns = 128;
+  static constexpr uint8_t kPages = 8;
+
+  const uint8_t _dc_gpio_pin;
+  uint8_t _ram[kPages][kColumns] = {};
+  // 0 = horizontal, 1 = vertical, 2 = page.
+  uint8_t _addressing_mode = 2;
+  uint8_t _column = 0;
+  uint8_t _page = 0;
+  uint8_t _column_start = 0;
+  uint8_t _column_end = kColumns - 1;
+  uint8_t _page_start = 0;
+  uint8_t _page_end = kPages - 1;
+  bool _display_on = false;
+  // The current command and its argument bytes.
+  uint8_t _cmd[8];
+  uint8_t _cmd_size = 0;
+  uint64_t _commands = 0;
+  uint64_t _data_bytes = 0;
+
+  void on_command_byte(uint8_t b);
+  void on_data_byte(uint8_t b);
+};
+
+// Generic SPI NOR flash with 256 bytes pages, 4KB sectors and 3 or 4 bytes
+// addresses. Program and erase complete after a few status reads, to
+// exercise the busy polling.
+class NorFlash : public DeviceModel {
+ public:
+  NorFlash(uint32_t size_bytes, const uint8_t jedec_id[3]);
+  ~NorFlash();
+
+  const uint8_t* memory() const { return _memory; }
+
+ protected:
+  virtual void on_begin() override;
+  virtual void on_end() override;
+  virtual uint8_t on_byte(uint32_t byte_index, uint8_t mosi) override;
+  virtual void print_state(FILE* f) const override;
+
+ private:
+  static constexpr uint8_t kBusyStatusReads = 2;
+
+  const uint32_t _size_bytes;
+  uint8_t _jedec_id[3];
+  uint8_t* const _memory;
+  bool _four_bytes_addr = false;
+  bool _write_enabled = false;
+  uint8_t _busy_status_reads = 0;
+  // The opcode of the current transaction, and its address.
+  uint8_t _opcode = 0;
+  uint32_t _addr = 0;
+  uint8_t _addr_bytes = 0;
+  uint64_t _bytes_read = 0;
+  uint64_t _bytes_programmed = 0;
+  uint64_t _erases = 0;
+  uint64_t _rejected = 0;
+
+  uint8_t addr_size() const;
+  void erase(uint32_t addr, uint32_t n);
+};
+
+// Creates a model from a command line spec, "name[:key=value,...]":
+//   ads1118[:ain0=<mV>,ain1=..,ain2=..,ain3=..]
+//   ad9833
+//   ssd1306:dc=<aux pin>
+//   flash[:size_kb=<n>]
+// Returns null if the spec is invalid.
+extern DeviceModel* create(const char* spec);
+
+}  // namespace devices
@@ -0,0 +1,60 @@
+// Simulator stand-in for the subset of the Arduino API that the firmware
+// uses.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+typedef unsigned int uint;
+
+typedef enum { LOW = 0, HIGH = 1 } PinStatus;
+typedef enum {
+  INPUT = 0,
+  OUTPUT = 1,
+  INPUT_PULLUP = 2,
+  INPUT_PULLDOWN = 3
+} PinMode;
+typedef uint8_t pin_size_t;
+
+#define PIN_SPI_SCK (18u)
+#define PIN_SPI_MOSI (19u)
+#define PIN_SPI_MISO (16u)
+
+extern void pinMode(pin_size_t pin, PinMode mode);
+extern void digitalWrite(pin_size_t pin, int value);
+extern PinStatus digitalRead(pin_size_t pin);
+
+extern unsigned long millis();
+extern unsigned long micros();
+extern void delay(unsigned long ms);
+extern void delayMicroseconds(unsigned int us);
+
+// A byte stream, per the Arduino Stream class.
+class Stream {
+ public:
+  virtual ~Stream() {}
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t* data, size_t n) = 0;
+  virtual void flush() {}
+  // Reads up to n bytes that are already available.
+  size_t readBytes(char* bfr, size_t n);
+  size_t readBytes(uint8_t* bfr, size_t n) { return readBytes((char*)bfr, n); }
+};
+
+// The USB serial, which the simulator connects to a pseudo terminal.
+class SimSerial : public Stream {
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  virtual int available() override;
+  virtual int read() override;
+  virtual size_t write(uint8_t b) override { return write(&b, 1); }
+  virtual size_t write(const uint8_t* data, size_t n) override;
+};
+
+extern SimSerial Serial;
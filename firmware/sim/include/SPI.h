@@ -0,0 +1,35 @@
+// Simulator stand-in for the Arduino SPI API. The transfers are passed to
+// the simulated devices, see sim.h.
+
+#pragma once
+
+#include "Arduino.h"
+
+typedef enum {
+  SPI_MODE0 = 0,
+  SPI_MODE1 = 1,
+  SPI_MODE2 = 2,
+  SPI_MODE3 = 3
+} SPIMode;
+
+typedef enum { LSBFIRST = 0, MSBFIRST = 1 } BitOrder;
+
+class SPISettings {
+ public:
+  SPISettings(uint32_t clock, BitOrder bit_order, SPIMode data_mode)
+      : clock(clock), bit_order(bit_order), data_mode(data_mode) {}
+  uint32_t clock;
+  BitOrder bit_order;
+  SPIMode data_mode;
+};
+
+class SPIClass {
+ public:
+  void begin() {}
+  void beginTransaction(SPISettings settings);
+  void endTransaction() {}
+  uint8_t transfer(uint8_t b);
+  void transfer(void* bfr, size_t n);
+};
+
+extern SPIClass SPI;
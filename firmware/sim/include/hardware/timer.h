@@ -0,0 +1,7 @@
+// Simulator stand-in for the pico-sdk timer API.
+
+#pragma once
+
+#include <stdint.h>
+
+extern uint32_t time_us_32();
@@ -0,0 +1,49 @@
+// Simulator hooks. Allow to attach simulated SPI devices and to observe
+// the simulated pins.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "SPI.h"
+
+namespace sim {
+
+// A simulated SPI device.
+class SpiDevice {
+ public:
+  virtual ~SpiDevice() {}
+  // Called when the device's CS is asserted or released.
+  virtual void on_select(bool selected) { (void)selected; }
+  // Called for each byte of a transfer while the device is selected.
+  // Returns the MISO byte.
+  virtual uint8_t transfer(uint8_t mosi) = 0;
+};
+
+// Attaches a device to the CS output with the given gpio pin. A null
+// device detaches. Transfers with no selected device loop back MOSI to
+// MISO.
+extern void attach_spi_device(uint8_t cs_gpio_pin, SpiDevice* device);
+
+// Returns the current level of a gpio pin.
+extern bool pin_level(uint8_t gpio_pin);
+
+// Sets the level of a gpio pin that is an input, as if driven externally.
+extern void set_input_level(uint8_t gpio_pin, bool level);
+
+// Returns the settings of the last SPI transaction.
+extern const SPISettings& spi_settings();
+
+// Sets a file that keeps the init script across runs, as the flash of a
+// real adapter. Without it, the init script is kept in memory only.
+extern void set_init_script_file(const char* path);
+
+// Opens the pseudo terminal of the USB serial. Returns its path, or null
+// if failed.
+extern const char* open_serial_pty();
+
+// Waits up to the given time for serial input. Used to avoid busy looping
+// while idle.
+extern void wait_for_serial_input(uint32_t max_wait_us);
+
+}  // namespace sim
@@ -0,0 +1,210 @@
+// Simulator implementation of the Arduino API stand-in, see Arduino.h and
+// SPI.h, and of the simulator hooks of sim.h.
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hardware/timer.h"
+#include "sim.h"
+
+SimSerial Serial;
+SPIClass SPI;
+
+// ----- Pins
+
+static constexpr uint8_t kNumGpioPins = 30;
+
+struct Pin {
+  PinMode mode = INPUT;
+  // The output value, for outputs.
+  bool output_level = false;
+  // The externally driven level, for inputs.
+  bool input_level = false;
+  bool has_input_level = false;
+  sim::SpiDevice* spi_device = nullptr;
+};
+
+static Pin pins[kNumGpioPins];
+
+bool sim::pin_level(uint8_t gpio_pin) {
+  const Pin& pin = pins[gpio_pin];
+  if (pin.mode == OUTPUT) {
+    return pin.output_level;
+  }
+  if (pin.has_input_level) {
+    return pin.input_level;
+  }
+  return pin.mode == INPUT_PULLUP;
+}
+
+void sim::set_input_level(uint8_t gpio_pin, bool level) {
+  pins[gpio_pin].input_level = level;
+  pins[gpio_pin].has_input_level = true;
+}
+
+void pinMode(pin_size_t pin, PinMode mode) {
+  if (pin < kNumGpioPins) {
+    pins[pin].mode = mode;
+  }
+}
+
+void digitalWrite(pin_size_t gpio_pin, int value) {
+  if (gpio_pin >= kNumGpioPins) {
+    return;
+  }
+  Pin& pin = pins[gpio_pin];
+  const bool old_level = sim::pin_level(gpio_pin);
+  pin.output_level = value;
+  const bool new_level = sim::pin_level(gpio_pin);
+  // CS outputs are active low.
+  if (pin.spi_device && new_level != old_level) {
+    pin.spi_device->on_select(!new_level);
+  }
+}
+
+PinStatus digitalRead(pin_size_t gpio_pin) {
+  return (gpio_pin < kNumGpioPins && sim::pin_level(gpio_pin)) ? HIGH : LOW;
+}
+
+// ----- Time
+
+static uint64_t start_us = 0;
+
+static uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t elapsed_us() {
+  if (!start_us) {
+    start_us = monotonic_us();
+  }
+  return monotonic_us() - start_us;
+}
+
+unsigned long millis() { return (unsigned long)(elapsed_us() / 1000); }
+
+unsigned long micros() { return (unsigned long)elapsed_us(); }
+
+uint32_t time_us_32() { return (uint32_t)elapsed_us(); }
+
+void delay(unsigned long ms) { usleep(ms * 1000); }
+
+void delayMicroseconds(unsigned int us) {
+  const uint64_t end_us = elapsed_us() + us;
+  while (elapsed_us() < end_us) {
+  }
+}
+
+// ----- Serial
+
+// The master side of the pseudo terminal.
+static int pty_fd = -1;
+
+const char* sim::open_serial_pty() {
+  pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty_fd < 0 || grantpt(pty_fd) || unlockpt(pty_fd)) {
+    return nullptr;
+  }
+  const char* slave_path = ptsname(pty_fd);
+  if (!slave_path) {
+    return nullptr;
+  }
+  // Keep the slave side open, so the master doesn't get errors while no
+  // host is connected, and make it raw so our output is not echoed back.
+  const int slave_fd = open(slave_path, O_RDWR | O_NOCTTY);
+  if (slave_fd < 0) {
+    return nullptr;
+  }
+  struct termios tio;
+  tcgetattr(slave_fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave_fd, TCSANOW, &tio);
+  return slave_path;
+}
+
+void sim::wait_for_serial_input(uint32_t max_wait_us) {
+  struct pollfd pfd = {pty_fd, POLLIN, 0};
+  poll(&pfd, 1, max_wait_us / 1000);
+}
+
+int SimSerial::available() {
+  int n = 0;
+  if (ioctl(pty_fd, FIONREAD, &n) < 0) {
+    return 0;
+  }
+  return n;
+}
+
+int SimSerial::read() {
+  uint8_t b;
+  return (available() && ::read(pty_fd, &b, 1) == 1) ? b : -1;
+}
+
+size_t SimSerial::write(const uint8_t* data, size_t n) {
+  size_t done = 0;
+  while (done < n) {
+    const ssize_t result = ::write(pty_fd, data + done, n - done);
+    if (result <= 0) {
+      usleep(100);
+      continue;
+    }
+    done += result;
+  }
+  return n;
+}
+
+size_t Stream::readBytes(char* bfr, size_t n) {
+  size_t done = 0;
+  while (done < n) {
+    const int b = read();
+    if (b < 0) {
+      break;
+    }
+    bfr[done++] = (char)b;
+  }
+  return done;
+}
+
+// ----- SPI
+
+static SPISettings last_spi_settings(4000000, MSBFIRST, SPI_MODE0);
+
+void sim::attach_spi_device(uint8_t cs_gpio_pin, SpiDevice* device) {
+  pins[cs_gpio_pin].spi_device = device;
+}
+
+const SPISettings& sim::spi_settings() { return last_spi_settings; }
+
+void SPIClass::beginTransaction(SPISettings settings) {
+  last_spi_settings = settings;
+}
+
+uint8_t SPIClass::transfer(uint8_t mosi) {
+  // MISO is wired-AND of the selected devices, or loopback if none.
+  bool any_selected = false;
+  uint8_t miso = 0xff;
+  for (uint8_t i = 0; i < kNumGpioPins; i++) {
+    if (pins[i].spi_device && !sim::pin_level(i)) {
+      miso &= pins[i].spi_device->transfer(mosi);
+      any_selected = true;
+    }
+  }
+  return any_selected ? miso : mosi;
+}
+
+void SPIClass::transfer(void* bfr, size_t n) {
+  uint8_t* p = (uint8_t*)bfr;
+  for (size_t i = 0; i < n; i++) {
+    p[i] = transfer(p[i]);
+  }
+}
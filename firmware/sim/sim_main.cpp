@@ -0,0 +1,101 @@
+// Entry point of the simulator. Runs the firmware's setup() and loop()
+// with the USB serial connected to a pseudo terminal, which the host
+// driver can open as a regular serial port.
+//
+// Usage: spi_adapter_sim [--device <cs>=<spec>]... [--init-script-file <path>]
+//
+// --device attaches a simulated device model to CS output <cs>, see
+// devices::create() for the specs. On SIGINT or SIGTERM, prints a summary
+// of each device and exits. --init-script-file keeps the init script in
+// a file, see sim::set_init_script_file().
+
+#include <Arduino.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "devices.h"
+#include "sim.h"
+
+// Defined by the firmware.
+extern void setup();
+extern void loop();
+
+// The gpio pins of the CS outputs, as in main.cpp.
+static constexpr uint8_t kCsGpioPins[] = {10, 11, 12, 13};
+static constexpr uint8_t kNumCsPins = sizeof(kCsGpioPins);
+
+static devices::DeviceModel* cs_devices[kNumCsPins] = {};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop_signal(int signum) {
+  (void)signum;
+  stop_requested = 1;
+}
+
+// Parses a "<cs>=<spec>" device argument. Returns false if invalid.
+static bool add_device(const char* arg) {
+  if (arg[0] < '0' || arg[0] >= '0' + kNumCsPins || arg[1] != '=') {
+    return false;
+  }
+  const uint8_t cs = arg[0] - '0';
+  devices::DeviceModel* device = devices::create(&arg[2]);
+  if (!device || cs_devices[cs]) {
+    delete device;
+    return false;
+  }
+  cs_devices[cs] = device;
+  sim::attach_spi_device(kCsGpioPins[cs], device);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--device") && has_value && add_device(argv[i + 1])) {
+      i++;
+    } else if (!strcmp(argv[i], "--init-script-file") && has_value) {
+      sim::set_init_script_file(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--device <cs>=<spec>]... "
+              "[--init-script-file <path>]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  const char* pty_path = sim::open_serial_pty();
+  if (!pty_path) {
+    perror("Failed to open a pseudo terminal");
+    return 1;
+  }
+  printf("SPI Adapter simulator, serial port: %s\n", pty_path);
+  for (uint8_t i = 0; i < kNumCsPins; i++) {
+    if (cs_devices[i]) {
+      printf("CS %u: %s\n", i, cs_devices[i]->name());
+    }
+  }
+  fflush(stdout);
+
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+
+  setup();
+  while (!stop_requested) {
+    loop();
+    // Avoid busy looping while idle.
+    if (!Serial.available()) {
+      sim::wait_for_serial_input(1000);
+    }
+  }
+
+  for (uint8_t i = 0; i < kNumCsPins; i++) {
+    if (cs_devices[i]) {
+      printf("CS %u, ", i);
+      cs_devices[i]->print_summary(stdout);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,268 @@
+// Simulator stand-ins of the firmware modules that use the RP2040
+// hardware directly. They keep the module APIs and behave as a real
+// adapter where practical, otherwise they report the resources as not
+// available.
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <stdio.h>
+
+#include "aux_capture.h"
+#include "aux_events.h"
+#include "aux_waveform.h"
+#include "board.h"
+#include "init_script.h"
+#include "qspi.h"
+#include "sim.h"
+#include "spi_hw.h"
+#include "timing.h"
+
+// ----- board
+
+class SimLed : public Led {
+ public:
+  virtual void update(bool led_state) override { (void)led_state; }
+};
+
+namespace board {
+static SimLed _led;
+Led& led = _led;
+void setup() {}
+}  // namespace board
+
+// ----- timing
+
+namespace timing {
+void setup() {}
+void busy_wait_ns(uint32_t ns) { delayMicroseconds((ns + 999) / 1000); }
+}  // namespace timing
+
+// ----- aux_waveform. A playback completes immediately, leaving the pins
+// with the values of the last entry.
+
+namespace aux_waveform {
+static uint8_t base_gpio_pin = 0;
+static uint16_t num_entries = 0;
+static uint8_t last_values = 0;
+
+void setup(uint8_t first_gpio_pin) { base_gpio_pin = first_gpio_pin; }
+void loop() {}
+void clear() { num_entries = 0; }
+
+bool add_entry(uint8_t aux_values, uint32_t duration_us) {
+  if (num_entries >= kMaxEntries || duration_us < kMinDurationUs ||
+      duration_us > kMaxDurationUs) {
+    return false;
+  }
+  num_entries++;
+  last_values = aux_values;
+  return true;
+}
+
+bool start(uint8_t aux_mask) {
+  if (!num_entries || !aux_mask) {
+    return false;
+  }
+  for (uint8_t i = 0; i < 8; i++) {
+    if (aux_mask & (1 << i)) {
+      pinMode(base_gpio_pin + i, OUTPUT);
+      digitalWrite(base_gpio_pin + i, last_values & (1 << i));
+    }
+  }
+  return true;
+}
+
+void stop() {}
+bool is_playing() { return false; }
+}  // namespace aux_waveform
+
+// ----- aux_capture. A capture completes immediately, with all the samples
+// equal to the current pin levels.
+
+namespace aux_capture {
+static uint8_t base_gpio_pin = 0;
+static uint8_t buffer[kMaxSamples];
+static uint32_t num_captured = 0;
+static State current_state = kIdle;
+
+void setup(uint8_t first_gpio_pin) { base_gpio_pin = first_gpio_pin; }
+
+bool start(uint32_t sample_rate_hz, uint32_t num_samples, bool trigger,
+           uint8_t trigger_aux_pin, bool trigger_rising_edge) {
+  (void)trigger;
+  (void)trigger_rising_edge;
+  if (sample_rate_hz < kMinSampleRateHz || sample_rate_hz > kMaxSampleRateHz ||
+      num_samples < 4 || num_samples > kMaxSamples || num_samples % 4 ||
+      trigger_aux_pin > 7) {
+    return false;
+  }
+  uint8_t levels = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    levels |= sim::pin_level(base_gpio_pin + i) << i;
+  }
+  memset(buffer, levels, num_samples);
+  num_captured = num_samples;
+  current_state = kDone;
+  return true;
+}
+
+void stop() { current_state = kIdle; }
+State state() { return current_state; }
+uint32_t samples_captured() { return num_captured; }
+const uint8_t* samples() { return buffer; }
+}  // namespace aux_capture
+
+// ----- aux_events. Pin changes are not simulated so there are no events.
+
+namespace aux_events {
+static uint8_t watched_mask = 0;
+
+void setup(uint8_t first_gpio_pin) { (void)first_gpio_pin; }
+void subscribe(uint8_t aux_mask) { watched_mask = aux_mask; }
+uint8_t subscribed_mask() { return watched_mask; }
+bool pop(Event* event) {
+  (void)event;
+  return false;
+}
+}  // namespace aux_events
+
+// ----- qspi. Not simulated, transactions fail for lack of PIO resources.
+
+namespace qspi {
+void setup(uint8_t io0_gpio_pin, uint8_t sck_gpio_pin) {
+  (void)io0_gpio_pin;
+  (void)sck_gpio_pin;
+}
+bool begin_transaction(uint32_t frequency_hz) {
+  (void)frequency_hz;
+  return false;
+}
+void end_transaction() {}
+void write(uint8_t width, const uint8_t* data, uint32_t n) {
+  (void)width;
+  (void)data;
+  (void)n;
+}
+void read(uint8_t width, uint8_t* data, uint32_t n) {
+  (void)width;
+  memset(data, 0xff, n);
+}
+void dummy_cycles(uint32_t n) { (void)n; }
+}  // namespace qspi
+
+// ----- spi_hw. Words are transferred as their big endian bytes and the
+// CRCs are computed in software.
+
+namespace spi_hw {
+void setup() {}
+
+uint8_t word_bytes(uint8_t word_bits) {
+  return (word_bits == kWordBits32)                               ? 4
+         : (word_bits < kMinWordBits || word_bits > kMaxFrameBits) ? 0
+         : (word_bits > 8)                                          ? 2
+                                                                    : 1;
+}
+
+void transfer_words(uint8_t word_bits, bool little_endian, uint8_t spi_mode,
+                    uint8_t* data, uint16_t n) {
+  (void)spi_mode;
+  const uint8_t num_bytes = word_bytes(word_bits);
+  for (uint16_t i = 0; i + num_bytes <= n; i += num_bytes) {
+    if (little_endian) {
+      std::reverse(&data[i], &data[i + num_bytes]);
+    }
+    SPI.transfer(&data[i], num_bytes);
+    if (little_endian) {
+      std::reverse(&data[i], &data[i + num_bytes]);
+    }
+  }
+}
+
+uint32_t read_crc(CrcType crc_type, uint32_t n) {
+  if (crc_type == kCrc32) {
+    uint32_t crc = 0xffffffff;
+    for (uint32_t i = 0; i < n; i++) {
+      crc ^= SPI.transfer(0x00);
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+      }
+    }
+    return ~crc;
+  }
+  uint16_t crc = 0xffff;
+  for (uint32_t i = 0; i < n; i++) {
+    crc ^= ((uint16_t)SPI.transfer(0x00)) << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc << 1) ^ ((crc & 0x8000) ? 0x1021 : 0);
+    }
+  }
+  return crc;
+}
+}  // namespace spi_hw
+
+// ----- init_script. The script is kept in memory and, if set, in a file.
+
+static const char* init_script_file = nullptr;
+
+void sim::set_init_script_file(const char* path) { init_script_file = path; }
+
+namespace init_script {
+static uint8_t stored[kMaxSize];
+static int32_t stored_size = -1;
+static uint8_t pending[kMaxSize];
+static uint16_t pending_size = 0;
+
+static void save() {
+  if (!init_script_file) {
+    return;
+  }
+  FILE* f = fopen(init_script_file, "wb");
+  if (f) {
+    if (stored_size > 0) {
+      fwrite(stored, 1, stored_size, f);
+    }
+    fclose(f);
+  }
+}
+
+const uint8_t* get(uint16_t* size) {
+  // Load the file on first use. An empty or missing file means no script.
+  if (stored_size < 0 && init_script_file) {
+    FILE* f = fopen(init_script_file, "rb");
+    if (f) {
+      stored_size = fread(stored, 1, sizeof(stored), f);
+      fclose(f);
+    }
+  }
+  if (stored_size < 0) {
+    return nullptr;
+  }
+  *size = stored_size;
+  return stored;
+}
+
+void begin_store() { pending_size = 0; }
+
+bool append(const uint8_t* data, uint16_t n) {
+  if (n > kMaxSize - pending_size) {
+    return false;
+  }
+  memcpy(&pending[pending_size], data, n);
+  pending_size += n;
+  return true;
+}
+
+bool end_store() {
+  memcpy(stored, pending, pending_size);
+  stored_size = pending_size;
+  save();
+  return true;
+}
+
+void clear() {
+  stored_size = -1;
+  if (init_script_file) {
+    remove(init_script_file);
+  }
+}
+}  // namespace init_script
@@ -2,9 +2,12 @@
 create an object of the  class SPIAdapter, and use the methods it provides.
 """
 
-from typing import Optional, List, Tuple
+from typing import Optional, List, Tuple, Callable, Dict
 from serial import Serial
 from enum import Enum
+from dataclasses import dataclass
+from collections import deque
+import os
 import time
 
 
@@ -17,17 +20,383 @@ class AuxPinMode(Enum):
     OUTPUT = 3
 
 
+# NOTE: Numeric values match wire protocol.
+class AuxCaptureState(Enum):
+    """States of an aux pins capture."""
+
+    IDLE = 0
+    ARMED = 1
+    CAPTURING = 2
+    DONE = 3
+
+
+# NOTE: Numeric values match wire protocol.
+class PollResult(Enum):
+    """The reason that :func:`SpiAdapter.poll` ended."""
+
+    MATCHED = 0
+    MAX_ITERATIONS = 1
+    TIMEOUT = 2
+
+
+@dataclass(frozen=True)
+class AuxEvent:
+    """A change of an aux pin that is watched with :func:`SpiAdapter.subscribe_aux_events`."""
+
+    #: The aux pin index, in the range [0, 7].
+    aux_pin: int
+    #: True if the pin had a falling edge.
+    falling_edge: bool
+    #: True if the pin had a rising edge. Both edges are set for short pulses.
+    rising_edge: bool
+    #: The values of all the aux pins right after the change.
+    aux_values: int
+    #: Time of the change, in usecs since the SPI Adapter started. Wraps around every
+    #: 2^32 usecs.
+    timestamp_us: int
+    #: True if events were lost before this one.
+    overflow: bool
+
+
+@dataclass(frozen=True)
+class TimingSummary:
+    """Statistics of a set of durations that are measured by the SPI Adapter."""
+
+    #: Number of durations.
+    count: int
+    #: Min duration in usecs.
+    min_us: int
+    #: Max duration in usecs.
+    max_us: int
+    #: Mean duration in usecs.
+    mean_us: int
+
+
+@dataclass(frozen=True)
+class AdapterStats:
+    """Timing and error statistics of the SPI Adapter, as returned by
+    :func:`SpiAdapter.get_stats`."""
+
+    #: Durations of the receive of command payloads, from the command selector to the last
+    #: payload byte.
+    receive: TimingSummary
+    #: Durations of the SPI transactions, from CS assertion to CS release.
+    spi: TimingSummary
+    #: Durations of passing response bytes to the USB serial.
+    transmit: TimingSummary
+    #: Number of commands that timed out.
+    timeouts: int
+    #: Number of unknown command selectors.
+    unknown_commands: int
+    #: Per command selector char, the command durations and the number of error responses.
+    commands: Dict[str, Tuple[TimingSummary, int]]
+
+
+@dataclass(frozen=True)
+class AdapterCapabilities:
+    """Capabilities of the SPI Adapter's firmware, as returned by
+    :func:`SpiAdapter.capabilities`."""
+
+    #: Version of the command API.
+    api_version: int
+    #: Firmware version.
+    firmware_version: int
+    #: True if SEND supports holding the CS between commands.
+    hold_cs: bool
+    #: True if SEND supports broadcast to several CS outputs.
+    broadcast: bool
+    #: True if SEND supports word sizes other than 8 bits.
+    word_format: bool
+    #: True if commands can be sent before the responses of the previous ones arrive.
+    pipelining: bool
+    #: Max number of data and extra bytes in a single SEND command.
+    max_transaction_bytes: int
+    #: Min SPI speed in Hz.
+    min_speed: int
+    #: Max SPI speed in Hz.
+    max_speed: int
+    #: Number of CS outputs.
+    num_cs: int
+    #: Number of aux pins.
+    num_aux_pins: int
+    #: Number of serial channels, each appearing as a separate serial port.
+    num_channels: int
+
+
+@dataclass(frozen=True)
+class TraceEntry:
+    """A command in the SPI Adapter's trace, as returned by :func:`SpiAdapter.read_trace`."""
+
+    #: Command start time, in usecs since the SPI Adapter started. Wraps around every
+    #: 2^32 usecs.
+    start_us: int
+    #: Command duration in usecs.
+    duration_us: int
+    #: Number of command bytes received, including the selector char. Saturated at 65535.
+    bytes_in: int
+    #: Number of response bytes sent. Saturated at 65535.
+    bytes_out: int
+    #: The command selector char, such as 's' for :func:`SpiAdapter.send`.
+    selector: str
+    #: 0 if OK, 255 if the command timed out, otherwise the error code of the error response.
+    status: int
+    #: The CS outputs of the last SPI transaction of the command, one bit per CS. 0 if none.
+    cs_mask: int
+    #: The SPI mode of the last SPI transaction of the command.
+    mode: int
+    #: The speed in Hz of the last SPI transaction of the command.
+    speed: int
+    #: The channel of the command, for firmware with several serial ports.
+    channel: int
+
+    def __str__(self) -> str:
+        status = "OK" if self.status == 0 else "TIMEOUT" if self.status == 255 else f"E{self.status}"
+        return (
+            f"{self.start_us:10d}us {self.duration_us:8d}us '{self.selector}' {status:7s} "
+            f"in={self.bytes_in} out={self.bytes_out} cs={self.cs_mask:04b} mode={self.mode} "
+            f"speed={self.speed} ch={self.channel}"
+        )
+
+
+def decode_trace(data: bytes | bytearray, entry_size: int = 20) -> List[TraceEntry]:
+    """Decode the entries of a raw SPI Adapter trace, as sent by the firmware.
+
+    :param data: The bytes of the trace entries.
+    :type data: bytes | bytearray
+
+    :param entry_size: The size in bytes of each entry, as reported by the firmware.
+    :type entry_size: int
+
+    :returns: The decoded entries, oldest first.
+    :rtype: List[TraceEntry]
+    """
+    assert entry_size >= 18
+    assert len(data) % entry_size == 0
+    result = []
+    for i in range(0, len(data), entry_size):
+        e = data[i : i + entry_size]
+        result.append(
+            TraceEntry(
+                start_us=int.from_bytes(e[0:4], byteorder="big"),
+                duration_us=int.from_bytes(e[4:8], byteorder="big"),
+                bytes_in=int.from_bytes(e[8:10], byteorder="big"),
+                bytes_out=int.from_bytes(e[10:12], byteorder="big"),
+                selector=chr(e[12]),
+                status=e[13],
+                cs_mask=e[14],
+                mode=e[15],
+                speed=e[16] * 25000,
+                channel=e[17],
+            )
+        )
+    return result
+
+
+# Max bytes of responses to pipelined commands that are not read yet. The SPI
+# Adapter doesn't buffer responses, so they should fit in the serial buffers of
+# the host OS, or the SPI Adapter blocks on sending them while we're still
+# writing. Well below the typical 4KB.
+_MAX_PIPELINED_RESPONSE_BYTES = 1024
+
+
+def _send_request(
+    data: bytearray | bytes,
+    extra_bytes: int,
+    cs: int | List[int],
+    mode: int,
+    speed: int,
+    read: bool,
+    hold_cs: bool,
+    word_bits: int,
+    little_endian: bool,
+) -> bytearray:
+    """Returns the request of a SEND command. See :func:`SpiAdapter.send` for the arguments."""
+    assert isinstance(data, (bytearray, bytes))
+    assert len(data) <= 256
+    assert isinstance(extra_bytes, int)
+    assert 0 <= extra_bytes <= 256
+    assert (len(data) + extra_bytes) <= 256
+    assert isinstance(cs, (int, list))
+    broadcast = isinstance(cs, list)
+    cs_list = cs if broadcast else [cs]
+    assert len(cs_list) > 0
+    for cs_index in cs_list:
+        assert isinstance(cs_index, int)
+        assert 0 <= cs_index <= 3
+    assert isinstance(mode, int)
+    assert 0 <= mode <= 3
+    assert isinstance(speed, int)
+    assert 25000 <= speed <= 4000000
+    assert isinstance(read, bool)
+    assert not (broadcast and read)
+    assert isinstance(hold_cs, bool)
+    assert isinstance(word_bits, int)
+    assert 4 <= word_bits <= 16 or word_bits == 32
+    assert isinstance(little_endian, bool)
+    word_bytes = 4 if word_bits == 32 else 2 if word_bits > 8 else 1
+    assert len(data) % word_bytes == 0
+    assert extra_bytes % word_bytes == 0
+    has_word_format = word_bits != 8 or little_endian
+
+    # Construct the command request.
+    req = bytearray()
+    req.append(ord("s"))
+    # print(f"Read: {read}", flush=True)
+    config_byte = 0b10000 if read else 0b00000
+    if hold_cs:
+        config_byte |= 0b100000
+    config_byte |= mode << 2
+    if broadcast:
+        config_byte |= 0b1000000
+    else:
+        config_byte |= cs
+    if has_word_format:
+        config_byte |= 0b10000000
+    # print(f"Config byte: {config_byte:08b}", flush=True)
+    req.append(config_byte)
+    speed_byte = int(round(speed / 25000))
+    # print(f"Speed byte: {speed_byte}, speed={speed}", flush=True)
+    assert isinstance(speed_byte, int)
+    assert 1 <= speed_byte <= 160
+    req.append(speed_byte)
+    req.append(len(data) // 256)
+    req.append(len(data) % 256)
+    req.append(extra_bytes // 256)
+    req.append(extra_bytes % 256)
+    if broadcast:
+        cs_mask = 0
+        for cs_index in cs_list:
+            cs_mask |= 1 << cs_index
+        req.append(cs_mask)
+    if has_word_format:
+        req.append(word_bits | (0b1000000 if little_endian else 0))
+    req.extend(data)
+    return req
+
+
+def _cs_timing_request(cs: int, setup_ns: int, hold_ns: int, gap_ns: int) -> bytearray:
+    """Returns the request of a CS TIMING command. See :func:`SpiAdapter.set_cs_timing`."""
+    assert isinstance(cs, int)
+    assert 0 <= cs <= 3
+    for value in (setup_ns, hold_ns, gap_ns):
+        assert isinstance(value, int)
+        assert 0 <= value <= 10000000
+    req = bytearray()
+    req.append(ord("t"))
+    req.append(cs)
+    req.extend(setup_ns.to_bytes(4, byteorder="big"))
+    req.extend(hold_ns.to_bytes(4, byteorder="big"))
+    req.extend(gap_ns.to_bytes(4, byteorder="big"))
+    return req
+
+
+def _aux_mode_request(pin: int, pin_mode: AuxPinMode) -> bytearray:
+    """Returns the request of an AUX MODE command. See :func:`SpiAdapter.set_aux_pin_mode`."""
+    assert isinstance(pin, int)
+    assert 0 <= pin <= 7
+    assert isinstance(pin_mode, AuxPinMode)
+    req = bytearray()
+    req.append(ord("m"))
+    req.append(pin)
+    req.append(pin_mode.value)
+    return req
+
+
+def _aux_write_request(values: int, mask: int) -> bytearray:
+    """Returns the request of an AUX WRITE command. See :func:`SpiAdapter.write_aux_pins`."""
+    assert isinstance(values, int)
+    assert 0 <= values <= 255
+    assert isinstance(mask, int)
+    assert 0 <= mask <= 255
+    req = bytearray()
+    req.append(ord("b"))
+    req.append(values)
+    req.append(mask)
+    return req
+
+
+class InitScript:
+    """A script of SPI transactions and aux pins operations that the SPI Adapter stores in its
+    flash and runs on startup, so the devices are initialized by the time the host connects.
+    Build the script with the methods below, which take the same arguments as the respective
+    :class:`SpiAdapter` methods, and store it with :func:`SpiAdapter.store_init_script`. The
+    methods return the script, so calls can be chained.
+
+    The script runs before the host connects, so transactions don't return read bytes and
+    errors are not reported. An invalid operation stops the script.
+    """
+
+    #: Max size of the script data, in bytes.
+    MAX_SIZE = 4088
+
+    def __init__(self):
+        self.__data = bytearray()
+
+    def data(self) -> bytes:
+        """Returns the script data, as stored in the SPI Adapter."""
+        return bytes(self.__data)
+
+    def __append(self, req: bytearray) -> "InitScript":
+        assert len(self.__data) + len(req) <= self.MAX_SIZE, "Init script is too large"
+        self.__data.extend(req)
+        return self
+
+    def send(
+        self,
+        data: bytearray | bytes,
+        cs: int | List[int] = 0,
+        mode: int = 0,
+        speed: int = 1000000,
+        hold_cs: bool = False,
+        word_bits: int = 8,
+        little_endian: bool = False,
+    ) -> "InitScript":
+        """Adds a write only SPI transaction. See :func:`SpiAdapter.send`."""
+        return self.__append(
+            _send_request(data, 0, cs, mode, speed, False, hold_cs, word_bits, little_endian)
+        )
+
+    def set_aux_pin_mode(self, pin: int, pin_mode: AuxPinMode) -> "InitScript":
+        """Adds the setting of an aux pin mode. See :func:`SpiAdapter.set_aux_pin_mode`."""
+        return self.__append(_aux_mode_request(pin, pin_mode))
+
+    def write_aux_pins(self, values: int, mask: int = 0b11111111) -> "InitScript":
+        """Adds a write of the aux pins. See :func:`SpiAdapter.write_aux_pins`."""
+        return self.__append(_aux_write_request(values, mask))
+
+    def set_cs_timing(
+        self, cs: int, setup_ns: int = 0, hold_ns: int = 0, gap_ns: int = 0
+    ) -> "InitScript":
+        """Adds the setting of a CS timing. See :func:`SpiAdapter.set_cs_timing`."""
+        return self.__append(_cs_timing_request(cs, setup_ns, hold_ns, gap_ns))
+
+
 class SpiAdapter:
     """Connects to the SPI Adapter at the specified serial port and asserts that the
     SPI responses as expcted.
 
     :param port: The serial port of the SPI Adapter. SPI Adapters
-        appear on the local computer as a standard serial port
+        appear on the local computer as a standard serial port. Firmware that is built with
+        several channels appears as several serial ports, which can be used independently,
+        for example by separate processes.
     :type port: str
     """
 
     def __init__(self, port: str):
         self.__serial: Serial = Serial(port, timeout=1.0)
+        self.__aux_events: deque = deque()
+        self.__aux_event_callback: Callable[[AuxEvent], None] | None = None
+        # The selectors of the commands that the firmware supports, or None if unknown.
+        self.__supported_commands: str | None = None
+        # The firmware capabilities, or None if the firmware doesn't report them.
+        self.__capabilities: AdapterCapabilities | None = None
+        # Connect with a single HELLO round trip. Older firmware ignores it, in which
+        # case we fall back to the echo test and the INFO command.
+        self.__serial.reset_input_buffer()
+        if self.__hello():
+            if "g" in self.__supported_commands:
+                self.__capabilities = self.__read_capabilities()
+            return
         if not self.test_connection_to_adapter():
             raise RuntimeError(f"spi driver not detected at port {port}")
         adapter_info = self.__read_adapter_info()
@@ -42,15 +411,89 @@ class SpiAdapter:
         ):
             raise RuntimeError(f"Unexpected SPI adapter info at {port}")
 
+    def __hello(self, max_tries: int = 2, timeout: float = 0.3) -> bool:
+        """Starts a session with the HELLO command. Returns False if the firmware doesn't
+        respond, for example because it doesn't support the command."""
+        saved_timeout = self.__serial.timeout
+        try:
+            for _ in range(max_tries):
+                # Non letter nonce bytes, so older firmware ignores them. A retry also
+                # covers a partial command of a previous session, that timed out by then.
+                nonce = bytes(b | 0x80 for b in os.urandom(4))
+                self.__serial.write(b"h" + nonce)
+                # Find the response, skipping stale bytes of a previous session.
+                expected = b"K" + nonce + b"SPI"
+                resp = bytearray()
+                deadline = time.monotonic() + timeout
+                while expected not in resp and time.monotonic() < deadline:
+                    self.__serial.timeout = max(0.001, deadline - time.monotonic())
+                    resp.extend(self.__serial.read(max(1, self.__serial.in_waiting)))
+                if expected not in resp:
+                    continue
+                # The rest of the response, API version, firmware version and the
+                # supported commands.
+                self.__serial.timeout = saved_timeout
+                tail = resp[resp.index(expected) + len(expected) :]
+                tail.extend(self.__serial.read(7 - len(tail)))
+                if len(tail) != 7:
+                    return False
+                print(f"Adapter info: {(b"SPI" + tail[0:3]).hex(" ")}", flush=True)
+                commands_mask = int.from_bytes(tail[3:7], byteorder="big")
+                self.__supported_commands = "".join(
+                    chr(ord("a") + i) for i in range(26) if commands_mask & (1 << i)
+                )
+                return True
+            return False
+        finally:
+            self.__serial.timeout = saved_timeout
+
+    def __read_capabilities(self) -> AdapterCapabilities | None:
+        """Reads the firmware capabilities with the EXTENDED INFO command. Returns None
+        if error."""
+        self.__serial.write(b"g")
+        ok_resp = self.__read_adapter_response("Extended info", 1)
+        if ok_resp is None:
+            return None
+        # Newer firmware may append fields, which we skip.
+        resp = self.__serial.read(ok_resp[0])
+        if len(resp) != ok_resp[0] or len(resp) < 20:
+            print(f"Extended info: unexpected response size {len(resp)}", flush=True)
+            return None
+        features = int.from_bytes(resp[3:7], byteorder="big")
+        return AdapterCapabilities(
+            api_version=resp[0],
+            firmware_version=int.from_bytes(resp[1:3], byteorder="big"),
+            hold_cs=bool(features & 0b1),
+            broadcast=bool(features & 0b10),
+            word_format=bool(features & 0b100),
+            pipelining=bool(features & 0b1000),
+            max_transaction_bytes=int.from_bytes(resp[7:9], byteorder="big"),
+            min_speed=int.from_bytes(resp[9:13], byteorder="big"),
+            max_speed=int.from_bytes(resp[13:17], byteorder="big"),
+            num_cs=resp[17],
+            num_aux_pins=resp[18],
+            num_channels=resp[19],
+        )
+
+    def capabilities(self) -> AdapterCapabilities | None:
+        """Returns the capabilities that the firmware reported when connecting, or None
+        if the firmware is too old to report them.
+
+        :rtype: AdapterCapabilities | None
+        """
+        return self.__capabilities
+
     def __read_adapter_response(self, op_name: str, ok_resp_size: int) -> bytes:
         """A common method to read a response from the adapter.
         Returns None if error, otherwise OK response bytes"""
         assert isinstance(op_name, str)
         assert isinstance(ok_resp_size, int)
         assert 0 <= ok_resp_size
-        # Read status flag.
+        # Read status flag, skipping aux event messages.
         ok_resp = self.__serial.read(1)
         assert isinstance(ok_resp, bytes), type(ok_resp)
+        while ok_resp == b"!" and self.__read_aux_event_message():
+            ok_resp = self.__serial.read(1)
         if len(ok_resp) != 1:
             print(
                 f"{op_name}: status flag read mismatch, expected {1}, got {len(ok_resp)}",
@@ -64,53 +507,910 @@ class SpiAdapter:
             )
             return None
 
-        # Handle the case of an error
-        if status_flag == ord("E"):
-            # Read the additional error info byte.
-            ok_resp = self.__serial.read(1)
-            assert isinstance(ok_resp, bytes), type(ok_resp)
-            if len(ok_resp) != 1:
-                print(
-                    f"{op_name}: error info read mismatch, expected {1}, got {len(ok_resp)}",
-                    flush=True,
-                )
-                return None
-            print(f"{op_name}: failed with error code {ok_resp[0]}", flush=True)
-            return None
+        # Handle the case of an error
+        if status_flag == ord("E"):
+            # Read the additional error info byte.
+            ok_resp = self.__serial.read(1)
+            assert isinstance(ok_resp, bytes), type(ok_resp)
+            if len(ok_resp) != 1:
+                print(
+                    f"{op_name}: error info read mismatch, expected {1}, got {len(ok_resp)}",
+                    flush=True,
+                )
+                return None
+            print(f"{op_name}: failed with error code {ok_resp[0]}", flush=True)
+            return None
+
+        # Handle the OK case.
+        #
+        # Read the returned data count.
+        ok_resp = self.__serial.read(ok_resp_size)
+        assert isinstance(ok_resp, bytes), type(ok_resp)
+        if len(ok_resp) != ok_resp_size:
+            print(
+                f"{op_name}: OK resp read count mismatch, expected {ok_resp_size}, got {len(ok_resp)}",
+                flush=True,
+            )
+            return None
+        return ok_resp
+
+    def send(
+        self,
+        data: bytearray | bytes,
+        extra_bytes: int = 0,
+        cs: int | List[int] = 0,
+        mode: int = 0,
+        speed: int = 1000000,
+        read: bool = True,
+        hold_cs: bool = False,
+        word_bits: int = 8,
+        little_endian: bool = False,
+    ) -> bytearray | None:
+        """Perform an SPI transaction.
+
+        :param write_data: Bytes to write to the device. The number of bytes must be 256 at most,
+          unless the firmware supports larger transactions, see below.
+        :type write_data: bytearray | bytes | None
+
+        :param extra_bytes: Number of additional ``0x00`` bytes to write to the device. This is typically use to read
+          a response from the device. The value ``len(data) + extra_bytes`` should not exceed 256. If the
+          firmware reports hold CS and pipelining in :func:`capabilities`, larger transactions are sent
+          as pipelined SEND commands that hold the CS between them.
+        :type extra_bytes: int
+
+        :param cs: The Chip Select (CS) output to use for this transaction. This allows to connect the SPI Adapter to multiple
+           SPI devices. If a list of CS outputs is given, they are all asserted at once to broadcast ``data`` to several
+           identical devices. Broadcast transactions are write only and require ``read=False``.
+        :type cs: int | List[int]
+
+        :param mode: The SPI mode to use. Should be in the range [0, 3].
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :param read: Indicates if the response should include the bytes read
+           on the MISO line during the writing of ``data`` and ``extra_bytes``.
+        :type read: bool
+
+        :param hold_cs: If True, the CS is kept asserted after the transaction so the next ``send()``
+           with the same ``cs`` continues the same device transaction. This allows to split large
+           device transactions into several ``send()`` calls. The CS is released by the first
+           ``send()`` with ``hold_cs=False``, by a ``send()`` with a different ``cs``, or by the
+           SPI Adapter if the next ``send()`` doesn't arrive within 500ms.
+        :type hold_cs: bool
+
+        :param word_bits: The SPI word size in bits, in the range [4, 16], or 32. Words of up to 8
+           bits take one byte each in ``data`` and in the returned bytes, words of 9 to 16 bits
+           take two bytes and words of 32 bits take four bytes. The unused upper bits are ignored
+           on write and are zero on read. The words are sent MSB first, with no gaps between them.
+           ``len(data)`` and ``extra_bytes`` should be multiples of the bytes per word.
+        :type word_bits: int
+
+        :param little_endian: If True, the bytes of each multi byte word in ``data`` and in the
+           returned bytes are in little endian order, otherwise in big endian order. This allows
+           to pass for example the bytes of a native array of 16 bit values as is.
+        :type little_endian: bool
+
+        :returns: If error, returns None, otherwise returns a ``bytearray``. If ``read == True``
+           then the bytearray contains exactly ``len(data) + extra_bytes`` bytes that were read during
+           the transaction. Otherwise the bytearray is empty(). Skipping the reading may improve
+           the performance of large write only transactions.
+        :rtype: bytearray | None
+        """
+        caps = self.__capabilities
+        if (
+            caps
+            and caps.hold_cs
+            and caps.pipelining
+            and len(data) + extra_bytes > caps.max_transaction_bytes
+        ):
+            return self.__send_chunked(
+                data, extra_bytes, cs, mode, speed, read, hold_cs, word_bits, little_endian
+            )
+        req = _send_request(
+            data, extra_bytes, cs, mode, speed, read, hold_cs, word_bits, little_endian
+        )
+        n = self.__serial.write(req)
+        if n != len(req):
+            print(f"SPI read: write mismatch, expected {len(req)}, got {n}", flush=True)
+            return None
+        return self.__read_send_response(len(data) + extra_bytes if read else 0)
+
+    def __read_send_response(self, expected_resp_count: int) -> bytearray | None:
+        """Reads the response of a SEND command. Returns the read bytes or None if error."""
+        ok_resp = self.__read_adapter_response("SPI read", 2)
+        if ok_resp is None:
+            return None
+
+        # Here response was OK. Get the count of returned data bytes read from the device.
+        resp_count = (ok_resp[0] << 8) + ok_resp[1]
+        if resp_count != expected_resp_count:
+            print(
+                f"SPI read: response count mismatch, expected {expected_resp_count}, got {resp_count}",
+                flush=True,
+            )
+            return None
+
+        # Read the data bytes
+        resp = self.__serial.read(resp_count)
+        assert isinstance(resp, bytes), type(resp)
+        if len(resp) != resp_count:
+            print(
+                f"SPI read: data read mismatch, expected {resp_count}, got {len(resp)}",
+                flush=True,
+            )
+            return None
+        return bytearray(resp)
+
+    def __send_chunked(
+        self,
+        data: bytearray | bytes,
+        extra_bytes: int,
+        cs: int | List[int],
+        mode: int,
+        speed: int,
+        read: bool,
+        hold_cs: bool,
+        word_bits: int,
+        little_endian: bool,
+    ) -> bytearray | None:
+        """Performs a transaction that is larger than the firmware's max transaction size,
+        as a series of SEND commands that hold the CS between them. The commands are
+        pipelined, up to _MAX_PIPELINED_RESPONSE_BYTES of unread responses."""
+        caps = self.__capabilities
+        assert caps is not None
+        word_bytes = 4 if word_bits == 32 else 2 if word_bits > 8 else 1
+        chunk_size = caps.max_transaction_bytes - caps.max_transaction_bytes % word_bytes
+        total = len(data) + extra_bytes
+        requests = []
+        for start in range(0, total, chunk_size):
+            end = min(start + chunk_size, total)
+            chunk_data = data[start : min(end, len(data))]
+            chunk_hold_cs = hold_cs or end < total
+            requests.append(
+                (
+                    _send_request(
+                        chunk_data,
+                        end - start - len(chunk_data),
+                        cs,
+                        mode,
+                        speed,
+                        read,
+                        chunk_hold_cs,
+                        word_bits,
+                        little_endian,
+                    ),
+                    end - start if read else 0,
+                )
+            )
+
+        # Send ahead while the unread responses fit in the budget, but at least the
+        # request whose response we read next. On error, we still read the responses
+        # of the requests that were already sent, to stay in sync.
+        result = bytearray()
+        ok = True
+        num_sent = 0
+        unread_resp_bytes = 0
+        for i, (_, expected_resp_count) in enumerate(requests):
+            while ok and num_sent < len(requests):
+                resp_bytes = 3 + requests[num_sent][1]
+                if num_sent > i and unread_resp_bytes + resp_bytes > _MAX_PIPELINED_RESPONSE_BYTES:
+                    break
+                self.__serial.write(requests[num_sent][0])
+                unread_resp_bytes += resp_bytes
+                num_sent += 1
+            if i >= num_sent:
+                break
+            resp = self.__read_send_response(expected_resp_count)
+            unread_resp_bytes -= 3 + expected_resp_count
+            if resp is None:
+                ok = False
+            else:
+                result.extend(resp)
+        return result if ok else None
+
+    def send_daisy_chain(
+        self,
+        devices_data: List[bytearray | bytes],
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 1000000,
+        read: bool = True,
+    ) -> List[bytearray] | None:
+        """Perform a single SPI transaction with a daisy chain of devices, such as shift registers
+        or LED drivers, where the data output of each device is connected to the data input of the
+        next one. The SPI Adapter orders the per device data on the wire and splits the read bytes
+        per device.
+
+        :param devices_data: The data to write to each device, starting with device 0 whose data
+            input is connected to the SPI Adapter's MOSI. All the devices should have the same
+            number of bytes, in the range [1, 256], and the total number of bytes should not
+            exceed 4096.
+        :type devices_data: List[bytearray | bytes]
+
+        :param cs: The Chip Select (CS) output of the chain, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use. Should be in the range [0, 3].
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :param read: Indicates if the response should include the bytes read from the devices.
+        :type read: bool
+
+        :returns: If error, returns None, otherwise returns a list with the bytes read from each
+            device, in the same order as ``devices_data``. The list is empty if ``read == False``.
+        :rtype: List[bytearray] | None
+        """
+        assert isinstance(devices_data, list)
+        assert len(devices_data) > 0
+        device_bytes = len(devices_data[0])
+        assert 1 <= device_bytes <= 256
+        for device_data in devices_data:
+            assert isinstance(device_data, (bytearray, bytes))
+            assert len(device_data) == device_bytes
+        assert len(devices_data) * device_bytes <= 4096
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert isinstance(mode, int)
+        assert 0 <= mode <= 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 4000000
+        assert isinstance(read, bool)
+
+        req = bytearray()
+        req.append(ord("d"))
+        config_byte = 0b10000 if read else 0b00000
+        config_byte |= mode << 2
+        config_byte |= cs
+        req.append(config_byte)
+        speed_byte = int(round(speed / 25000))
+        assert 1 <= speed_byte <= 160
+        req.append(speed_byte)
+        req.extend(len(devices_data).to_bytes(2, byteorder="big"))
+        req.extend(device_bytes.to_bytes(2, byteorder="big"))
+        for device_data in devices_data:
+            req.extend(device_data)
+        self.__serial.write(req)
+
+        ok_resp = self.__read_adapter_response("Daisy chain", 2)
+        if ok_resp is None:
+            return None
+        resp_count = (ok_resp[0] << 8) + ok_resp[1]
+        expected_resp_count = len(devices_data) * device_bytes if read else 0
+        if resp_count != expected_resp_count:
+            print(
+                f"Daisy chain: response count mismatch, expected {expected_resp_count}, got {resp_count}",
+                flush=True,
+            )
+            return None
+        resp = self.__serial.read(resp_count)
+        assert isinstance(resp, bytes), type(resp)
+        if len(resp) != resp_count:
+            print(
+                f"Daisy chain: data read mismatch, expected {resp_count}, got {len(resp)}",
+                flush=True,
+            )
+            return None
+        return [
+            bytearray(resp[i : i + device_bytes]) for i in range(0, resp_count, device_bytes)
+        ]
+
+    def qspi_transaction(
+        self,
+        cs: int = 0,
+        cmd: Optional[int] = None,
+        addr: Optional[int] = None,
+        addr_bytes: int = 3,
+        dummy_cycles: int = 0,
+        data: Optional[bytearray | bytes] = None,
+        read_count: int = 0,
+        lines: Tuple[int, int, int] = (1, 1, 4),
+        speed: int = 4000000,
+    ) -> bytearray | None:
+        """Perform a single dual or quad SPI transaction, such as a fast read or a quad page
+        program of a serial flash. The transaction consists of an optional command byte, an
+        optional address, optional dummy clock cycles and a data phase which is either a write
+        or a read. The data lines IO0-IO3 are the aux pins 4-7 and the clock is the regular SCK
+        pin. In the single line phases, data is written on IO0 and read from IO1. Only SPI mode
+        0 is supported.
+
+        :param cs: The Chip Select (CS) output to use, in the range [0, 3].
+        :type cs: int
+
+        :param cmd: An optional command byte to send first.
+        :type cmd: int | None
+
+        :param addr: An optional address to send after the command byte.
+        :type addr: int | None
+
+        :param addr_bytes: The number of address bytes, in the range [1, 4]. Sent big endian.
+        :type addr_bytes: int
+
+        :param dummy_cycles: The number of dummy clock cycles before the data phase, in the
+            range [0, 255].
+        :type dummy_cycles: int
+
+        :param data: Optional bytes to write in the data phase, up to 256 bytes. Can't be
+            combined with ``read_count``.
+        :type data: bytearray | bytes | None
+
+        :param read_count: The number of bytes to read in the data phase, in the range
+            [0, 65535].
+        :type read_count: int
+
+        :param lines: The number of data lines of the command, address and data phases. Each
+            should be 1, 2 or 4.
+        :type lines: Tuple[int, int, int]
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 20Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :returns: If error, returns None, otherwise returns the bytes read. Empty for writes.
+        :rtype: bytearray | None
+        """
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert cmd is None or 0 <= cmd <= 255
+        assert addr is None or 1 <= addr_bytes <= 4
+        assert addr is None or 0 <= addr < (1 << (8 * addr_bytes))
+        assert 0 <= dummy_cycles <= 255
+        assert data is None or isinstance(data, (bytearray, bytes))
+        assert data is None or len(data) <= 256
+        assert isinstance(read_count, int)
+        assert 0 <= read_count <= 65535
+        assert data is None or read_count == 0
+        assert len(lines) == 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 20000000
+
+        line_codes = {1: 0, 2: 1, 4: 2}
+        for n in lines:
+            assert n in line_codes, f"Invalid number of lines: {n}"
+
+        req = bytearray()
+        req.append(ord("q"))
+        config_byte = cs
+        if data is not None:
+            config_byte |= 0b100
+        if cmd is not None:
+            config_byte |= 0b1000
+        req.append(config_byte)
+        req.append(
+            line_codes[lines[0]] | (line_codes[lines[1]] << 2) | (line_codes[lines[2]] << 4)
+        )
+        req.append(0 if addr is None else addr_bytes)
+        req.append(dummy_cycles)
+        speed_units = int(round(speed / 25000))
+        assert 1 <= speed_units <= 800
+        req.extend(speed_units.to_bytes(2, byteorder="big"))
+        req.append(0 if cmd is None else cmd)
+        req.extend((0 if addr is None else addr).to_bytes(4, byteorder="big"))
+        data_count = len(data) if data is not None else read_count
+        req.extend(data_count.to_bytes(2, byteorder="big"))
+        if data is not None:
+            req.extend(data)
+        self.__serial.write(req)
+
+        ok_resp = self.__read_adapter_response("QSPI", 2)
+        if ok_resp is None:
+            return None
+        resp_count = (ok_resp[0] << 8) + ok_resp[1]
+        expected_resp_count = 0 if data is not None else read_count
+        if resp_count != expected_resp_count:
+            print(
+                f"QSPI: response count mismatch, expected {expected_resp_count}, got {resp_count}",
+                flush=True,
+            )
+            return None
+        resp = self.__serial.read(resp_count)
+        assert isinstance(resp, bytes), type(resp)
+        if len(resp) != resp_count:
+            print(
+                f"QSPI: data read mismatch, expected {resp_count}, got {len(resp)}",
+                flush=True,
+            )
+            return None
+        return bytearray(resp)
+
+    def __flash_request(
+        self, op: str, cs: int, mode: int, speed: int, four_bytes_addr: bool
+    ) -> bytearray:
+        """Returns the common header of a flash request."""
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert isinstance(mode, int)
+        assert 0 <= mode <= 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 4000000
+        assert isinstance(four_bytes_addr, bool)
+        req = bytearray()
+        req.append(ord("f"))
+        req.append(ord(op))
+        config_byte = 0b10000 if four_bytes_addr else 0b00000
+        config_byte |= mode << 2
+        config_byte |= cs
+        req.append(config_byte)
+        speed_byte = int(round(speed / 25000))
+        assert 1 <= speed_byte <= 160
+        req.append(speed_byte)
+        return req
+
+    def flash_read_jedec_id(
+        self, cs: int = 0, mode: int = 0, speed: int = 4000000
+    ) -> bytearray | None:
+        """Read the 3 bytes JEDEC ID of a SPI NOR flash.
+
+        :param cs: The Chip Select (CS) output of the flash, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use, typically 0 or 3.
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz.
+        :type speed: int
+
+        :returns: If error, returns None, otherwise the manufacturer ID, memory type and
+            capacity bytes.
+        :rtype: bytearray | None
+        """
+        req = self.__flash_request("j", cs, mode, speed, False)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Flash ID", 3)
+        if ok_resp is None:
+            return None
+        return bytearray(ok_resp)
+
+    def flash_read(
+        self,
+        addr: int,
+        count: int,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 4000000,
+        four_bytes_addr: bool = False,
+    ) -> bytearray | None:
+        """Read a range of a SPI NOR flash, using the fast read command. The data is streamed
+        by the SPI Adapter in a single response, regardless of its size.
+
+        :param addr: The start address.
+        :type addr: int
+
+        :param count: The number of bytes to read.
+        :type count: int
+
+        :param cs: The Chip Select (CS) output of the flash, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use, typically 0 or 3.
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz.
+        :type speed: int
+
+        :param four_bytes_addr: If True, 4 bytes addresses are used, otherwise 3 bytes. The
+            flash should be in the matching address mode.
+        :type four_bytes_addr: bool
+
+        :returns: If error, returns None, otherwise the bytes read.
+        :rtype: bytearray | None
+        """
+        assert isinstance(addr, int)
+        assert isinstance(count, int)
+        assert 0 <= addr and 0 <= count
+        assert addr + count <= (1 << (32 if four_bytes_addr else 24))
+        req = self.__flash_request("r", cs, mode, speed, four_bytes_addr)
+        req.extend(addr.to_bytes(4, byteorder="big"))
+        req.extend(count.to_bytes(4, byteorder="big"))
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Flash read", 4)
+        if ok_resp is None:
+            return None
+        resp_count = int.from_bytes(ok_resp, byteorder="big")
+        if resp_count != count:
+            print(
+                f"Flash read: response count mismatch, expected {count}, got {resp_count}",
+                flush=True,
+            )
+            return None
+        # Allow for the transfer time, with a 2x margin.
+        resp = self.__read_with_timeout(count, 1.0 + 2 * count * 8 / speed)
+        if len(resp) != count:
+            print(
+                f"Flash read: data read mismatch, expected {count}, got {len(resp)}",
+                flush=True,
+            )
+            return None
+        return bytearray(resp)
+
+    def flash_program(
+        self,
+        addr: int,
+        data: bytearray | bytes,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 4000000,
+        four_bytes_addr: bool = False,
+    ) -> bool:
+        """Program data to a SPI NOR flash. The SPI Adapter splits the data on page boundaries
+        and waits for the flash to complete each page. The range should be erased first.
+
+        :param addr: The start address.
+        :type addr: int
+
+        :param data: The bytes to program.
+        :type data: bytearray | bytes
+
+        :param cs: The Chip Select (CS) output of the flash, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use, typically 0 or 3.
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz.
+        :type speed: int
+
+        :param four_bytes_addr: If True, 4 bytes addresses are used, otherwise 3 bytes. The
+            flash should be in the matching address mode.
+        :type four_bytes_addr: bool
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        assert isinstance(addr, int)
+        assert isinstance(data, (bytearray, bytes))
+        assert 0 <= addr
+        assert addr + len(data) <= (1 << (32 if four_bytes_addr else 24))
+        req = self.__flash_request("p", cs, mode, speed, four_bytes_addr)
+        req.extend(addr.to_bytes(4, byteorder="big"))
+        req.extend(len(data).to_bytes(4, byteorder="big"))
+        req.extend(data)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Flash program", 0)
+        return ok_resp is not None
+
+    def flash_erase(
+        self,
+        addr: int,
+        erase_size: int = 4096,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 4000000,
+        four_bytes_addr: bool = False,
+    ) -> bool:
+        """Erase a sector, a block, or the entire SPI NOR flash, and wait for completion.
+
+        :param addr: An address within the sector or block to erase. Ignored for a chip erase.
+        :type addr: int
+
+        :param erase_size: The erase size. One of 4096, 32768, 65536, or 0 for chip erase.
+        :type erase_size: int
+
+        :param cs: The Chip Select (CS) output of the flash, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use, typically 0 or 3.
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz.
+        :type speed: int
+
+        :param four_bytes_addr: If True, 4 bytes addresses are used, otherwise 3 bytes. The
+            flash should be in the matching address mode.
+        :type four_bytes_addr: bool
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        # Erase type and the SPI Adapter's max wait time in secs, per erase size.
+        erase_types = {4096: (0, 1), 32768: (1, 2), 65536: (2, 4), 0: (3, 400)}
+        assert erase_size in erase_types, f"Invalid erase size: {erase_size}"
+        assert isinstance(addr, int)
+        assert 0 <= addr < (1 << (32 if four_bytes_addr else 24))
+        erase_type, max_secs = erase_types[erase_size]
+        req = self.__flash_request("e", cs, mode, speed, four_bytes_addr)
+        req.append(erase_type)
+        req.extend(addr.to_bytes(4, byteorder="big"))
+        self.__serial.write(req)
+        saved_timeout = self.__serial.timeout
+        self.__serial.timeout = max_secs + 1.0
+        try:
+            ok_resp = self.__read_adapter_response("Flash erase", 0)
+        finally:
+            self.__serial.timeout = saved_timeout
+        return ok_resp is not None
+
+    def __read_with_timeout(self, n: int, timeout: float) -> bytes:
+        """Reads n bytes from the serial port, with a given timeout instead of the default one."""
+        saved_timeout = self.__serial.timeout
+        self.__serial.timeout = max(saved_timeout, timeout)
+        try:
+            resp = self.__serial.read(n)
+        finally:
+            self.__serial.timeout = saved_timeout
+        assert isinstance(resp, bytes), type(resp)
+        return resp
+
+    def poll(
+        self,
+        data: bytearray | bytes,
+        byte_index: int,
+        mask: int,
+        value: int,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 1000000,
+        interval_us: int = 0,
+        max_iterations: int = 65535,
+        timeout: float = 1.0,
+    ) -> Tuple[PollResult, int, bytearray] | None:
+        """Repeat an SPI transaction on the SPI Adapter until
+        ``(response[byte_index] & mask) == value``. This allows to wait for a device, for example
+        for the WIP bit of a flash status register to clear, with a single round trip.
+
+        :param data: The bytes to write in each transaction, 1 to 32 bytes.
+        :type data: bytearray | bytes
+
+        :param byte_index: The index of the tested response byte. Should be less than ``len(data)``.
+        :type byte_index: int
+
+        :param mask: The mask of the tested response byte, in the range [0, 255].
+        :type mask: int
+
+        :param value: The value to match, after applying the mask, in the range [0, 255].
+        :type value: int
+
+        :param cs: The Chip Select (CS) output to use, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use. Should be in the range [0, 3].
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :param interval_us: The delay between transactions in usecs, in the range [0, 65535].
+        :type interval_us: int
+
+        :param max_iterations: The max number of transactions, in the range [1, 65535].
+        :type max_iterations: int
+
+        :param timeout: The max polling time in seconds, in the range [0, 65.535].
+        :type timeout: float
+
+        :returns: If error, returns None, otherwise a tuple with the reason the polling ended,
+            the number of transactions performed, and the bytes read in the last transaction.
+        :rtype: Tuple[PollResult, int, bytearray] | None
+        """
+        assert isinstance(data, (bytearray, bytes))
+        assert 1 <= len(data) <= 32
+        assert 0 <= byte_index < len(data)
+        assert 0 <= mask <= 255
+        assert 0 <= value <= 255
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert isinstance(mode, int)
+        assert 0 <= mode <= 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 4000000
+        assert 0 <= interval_us <= 65535
+        assert 1 <= max_iterations <= 65535
+        timeout_millis = int(round(timeout * 1000))
+        assert 0 <= timeout_millis <= 65535
+
+        req = bytearray()
+        req.append(ord("p"))
+        req.append((mode << 2) | cs)
+        speed_byte = int(round(speed / 25000))
+        assert 1 <= speed_byte <= 160
+        req.append(speed_byte)
+        req.append(len(data))
+        req.append(byte_index)
+        req.append(mask)
+        req.append(value)
+        req.extend(interval_us.to_bytes(2, byteorder="big"))
+        req.extend(max_iterations.to_bytes(2, byteorder="big"))
+        req.extend(timeout_millis.to_bytes(2, byteorder="big"))
+        req.extend(data)
+        self.__serial.write(req)
+
+        # The response may be delayed by up to the polling timeout. The max iterations don't
+        # bound it further since the duration of each transaction adds to its interval.
+        max_secs = timeout
+        saved_timeout = self.__serial.timeout
+        self.__serial.timeout = saved_timeout + max_secs
+        try:
+            ok_resp = self.__read_adapter_response("Poll", 3 + len(data))
+        finally:
+            self.__serial.timeout = saved_timeout
+        if ok_resp is None:
+            return None
+        result = PollResult(ok_resp[0])
+        iterations = (ok_resp[1] << 8) + ok_resp[2]
+        return (result, iterations, bytearray(ok_resp[3:]))
+
+    def read_crc(
+        self,
+        prefix: bytearray | bytes,
+        count: int,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 4000000,
+        crc16: bool = False,
+    ) -> int | None:
+        """Perform an SPI transaction that writes ``prefix`` and then reads ``count`` bytes, and
+        return the CRC of the read bytes rather than the bytes themselves. The CRC is computed
+        by the SPI Adapter's hardware at the SPI speed. For example, to verify a flash image,
+        use a fast read command and address as the prefix and compare the result to
+        ``zlib.crc32(image)``.
+
+        :param prefix: The bytes to write first, up to 16 bytes. The bytes read while writing
+            them are not included in the CRC.
+        :type prefix: bytearray | bytes
+
+        :param count: The number of bytes to read after the prefix, while writing ``0x00`` bytes.
+        :type count: int
+
+        :param cs: The Chip Select (CS) output to use, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use. Should be in the range [0, 3].
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :param crc16: If True, returns a CRC-16/CCITT-FALSE, otherwise a CRC-32 that matches
+            ``zlib.crc32()``.
+        :type crc16: bool
+
+        :returns: If error, returns None, otherwise the CRC.
+        :rtype: int | None
+        """
+        assert isinstance(prefix, (bytearray, bytes))
+        assert len(prefix) <= 16
+        assert isinstance(count, int)
+        assert 0 <= count < (1 << 32)
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert isinstance(mode, int)
+        assert 0 <= mode <= 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 4000000
+        assert isinstance(crc16, bool)
+
+        req = bytearray()
+        req.append(ord("r"))
+        config_byte = 0b10000 if crc16 else 0b00000
+        config_byte |= mode << 2
+        config_byte |= cs
+        req.append(config_byte)
+        speed_byte = int(round(speed / 25000))
+        assert 1 <= speed_byte <= 160
+        req.append(speed_byte)
+        req.append(len(prefix))
+        req.extend(count.to_bytes(4, byteorder="big"))
+        req.extend(prefix)
+        self.__serial.write(req)
+
+        # Allow for the transfer time, with a 2x margin.
+        saved_timeout = self.__serial.timeout
+        self.__serial.timeout = saved_timeout + 2 * count * 8 / speed
+        try:
+            ok_resp = self.__read_adapter_response("CRC", 4)
+        finally:
+            self.__serial.timeout = saved_timeout
+        if ok_resp is None:
+            return None
+        return int.from_bytes(ok_resp, byteorder="big")
+
+    def verify(
+        self,
+        prefix: bytearray | bytes,
+        expected: bytearray | bytes,
+        cs: int = 0,
+        mode: int = 0,
+        speed: int = 4000000,
+    ) -> Tuple[bool, int | None] | None:
+        """Perform an SPI transaction that writes ``prefix`` and then reads ``len(expected)`` bytes,
+        and compare the read bytes to ``expected`` on the SPI Adapter. Only the result is
+        returned, so this is useful for example to verify a flash page after programming it,
+        with a fast read command and address as the prefix.
+
+        :param prefix: The bytes to write first, up to 16 bytes. The bytes read while writing
+            them are not compared.
+        :type prefix: bytearray | bytes
+
+        :param expected: The expected bytes to read after the prefix, while writing ``0x00``
+            bytes.
+        :type expected: bytearray | bytes
+
+        :param cs: The Chip Select (CS) output to use, in the range [0, 3].
+        :type cs: int
+
+        :param mode: The SPI mode to use. Should be in the range [0, 3].
+        :type mode: int
+
+        :param speed: The SPI speed in Hz and must be in the range 25Khz to 4Mhz. The value
+                      is rounded silently to a 25Khz increment.
+        :type speed: int
+
+        :returns: If error, returns None, otherwise a tuple with True if all the bytes matched
+            and the offset in ``expected`` of the first mismatching byte, or None if all matched.
+        :rtype: Tuple[bool, int | None] | None
+        """
+        assert isinstance(prefix, (bytearray, bytes))
+        assert len(prefix) <= 16
+        assert isinstance(expected, (bytearray, bytes))
+        assert len(expected) < (1 << 32)
+        assert isinstance(cs, int)
+        assert 0 <= cs <= 3
+        assert isinstance(mode, int)
+        assert 0 <= mode <= 3
+        assert isinstance(speed, int)
+        assert 25000 <= speed <= 4000000
+
+        req = bytearray()
+        req.append(ord("v"))
+        req.append((mode << 2) | cs)
+        speed_byte = int(round(speed / 25000))
+        assert 1 <= speed_byte <= 160
+        req.append(speed_byte)
+        req.append(len(prefix))
+        req.extend(len(expected).to_bytes(4, byteorder="big"))
+        req.extend(prefix)
+        req.extend(expected)
+        self.__serial.write(req)
 
-        # Handle the OK case.
-        #
-        # Read the returned data count.
-        ok_resp = self.__serial.read(ok_resp_size)
-        assert isinstance(ok_resp, bytes), type(ok_resp)
-        if len(ok_resp) != ok_resp_size:
-            print(
-                f"{op_name}: OK resp read count mismatch, expected {ok_resp_size}, got {len(ok_resp)}",
-                flush=True,
-            )
+        ok_resp = self.__read_adapter_response("Verify", 5)
+        if ok_resp is None:
             return None
-        return ok_resp
+        if ok_resp[0] == 0:
+            return (True, None)
+        return (False, int.from_bytes(ok_resp[1:5], byteorder="big"))
 
-    def send(
+    def update_display(
         self,
-        data: bytearray | bytes,
-        extra_bytes: int = 0,
+        frame: bytearray | bytes,
+        dc_aux_pin: int,
+        width: int = 128,
+        height: int = 64,
         cs: int = 0,
         mode: int = 0,
-        speed: int = 1000000,
-        read: bool = True,
-    ) -> bytearray | None:
-        """Perform an SPI transaction.
+        speed: int = 4000000,
+        column_offset: int = 0,
+        sh1106: bool = False,
+        full_update: bool = False,
+    ) -> int | None:
+        """Update a monochrome page based display, such as an SSD1306 OLED, with a full frame.
+        The SPI Adapter keeps a mirror of the display RAM and sends to the display only the
+        columns of each page that changed since the last frame, so the update time depends
+        on the amount of change rather than on the display size. The mirror is of the last
+        updated display, so alternating between displays sends full frames.
 
-        :param write_data: Bytes to write to the device. The number of bytes must be 256 at most.
-        :type write_data: bytearray | bytes | None
+        :param frame: The frame in the display RAM format, ``height / 8`` pages of ``width``
+            bytes each, where each byte is a column of 8 pixel rows.
+        :type frame: bytearray | bytes
 
-        :param extra_bytes: Number of additional ``0x00`` bytes to write to the device. This is typically use to read
-          a response from the device. The value ``len(data) + extra_bytes`` should not exceed 256.
-        :type extra_bytes: int
+        :param dc_aux_pin: The aux pin that drives the display's DC input. It should be set
+            as an output.
+        :type dc_aux_pin: int
 
-        :param cs: The Chip Select (CS) output to use for this transaction. This allows to connect the SPI Adapter to multiple
-           SPI devices.
+        :param width: The display width in pixels, in the range [1, 128].
+        :type width: int
+
+        :param height: The display height in pixels, a multiple of 8 in the range [8, 64].
+        :type height: int
+
+        :param cs: The Chip Select (CS) output of the display, in the range [0, 3].
         :type cs: int
 
         :param mode: The SPI mode to use. Should be in the range [0, 3].
@@ -120,78 +1420,239 @@ class SpiAdapter:
                       is rounded silently to a 25Khz increment.
         :type speed: int
 
-        :param read: Indicates if the response should include the bytes read
-           on the MISO line during the writing of ``data`` and ``extra_bytes``.
-        :type read: bool
+        :param column_offset: The display RAM column of the first pixel column. Typically 0 for
+            SSD1306 and 2 for SH1106.
+        :type column_offset: int
 
-        :returns: If error, returns None, otherwise returns a ``bytearray``. If ``read == True``
-           then the bytearray contains exactly ``len(data) + extra_bytes`` bytes that were read during
-           the transaction. Otherwise the bytearray is empty(). Skipping the reading may improve
-           the performance of large write only transactions.
-        :rtype: bytearray | None
+        :param sh1106: If True, uses the SH1106 page addressing commands, otherwise the SSD1306
+            column and page range commands.
+        :type sh1106: bool
+
+        :param full_update: If True, the entire frame is sent, regardless of the mirror. Use it
+            if the display was changed by other means, such as a reset.
+        :type full_update: bool
+
+        :returns: If error, returns None, otherwise the number of frame bytes that were sent to
+            the display.
+        :rtype: int | None
         """
-        assert isinstance(data, (bytearray, bytes))
-        assert len(data) <= 256
-        assert isinstance(extra_bytes, int)
-        assert 0 <= extra_bytes <= 256
-        assert (len(data) + extra_bytes) <= 256
+        assert isinstance(dc_aux_pin, int)
+        assert 0 <= dc_aux_pin <= 7
+        assert isinstance(width, int)
+        assert 1 <= width <= 128
+        assert isinstance(height, int)
+        assert 8 <= height <= 64 and height % 8 == 0
+        assert isinstance(frame, (bytearray, bytes))
+        assert len(frame) == width * height // 8
         assert isinstance(cs, int)
         assert 0 <= cs <= 3
         assert isinstance(mode, int)
         assert 0 <= mode <= 3
         assert isinstance(speed, int)
         assert 25000 <= speed <= 4000000
-        assert isinstance(read, bool)
+        assert 0 <= column_offset <= 255 - width
+        assert isinstance(sh1106, bool)
+        assert isinstance(full_update, bool)
 
-        # Construct and send the command request.
         req = bytearray()
-        req.append(ord("s"))
-        # print(f"Read: {read}", flush=True)
-        config_byte = 0b10000 if read else 0b00000
-        config_byte |= mode << 2
-        config_byte |= cs
-        # print(f"Config byte: {config_byte:08b}", flush=True)
+        req.append(ord("o"))
+        config_byte = (mode << 2) | cs
+        if full_update:
+            config_byte |= 0b10000
+        if sh1106:
+            config_byte |= 0b100000
         req.append(config_byte)
         speed_byte = int(round(speed / 25000))
-        # print(f"Speed byte: {speed_byte}, speed={speed}", flush=True)
-        assert isinstance(speed_byte, int)
         assert 1 <= speed_byte <= 160
         req.append(speed_byte)
-        req.append(len(data) // 256)
-        req.append(len(data) % 256)
-        req.append(extra_bytes // 256)
-        req.append(extra_bytes % 256)
-        req.extend(data)
-        n = self.__serial.write(req)
-        if n != len(req):
-            print(f"SPI read: write mismatch, expected {len(req)}, got {n}", flush=True)
+        req.append(dc_aux_pin)
+        req.append(width)
+        req.append(height // 8)
+        req.append(column_offset)
+        req.extend(frame)
+        self.__serial.write(req)
+
+        ok_resp = self.__read_adapter_response("Display", 2)
+        if ok_resp is None:
             return None
+        return (ok_resp[0] << 8) + ok_resp[1]
 
-        # Read response.
-        ok_resp = self.__read_adapter_response("SPI read", 2)
+    def get_stats(self, reset: bool = False) -> AdapterStats | None:
+        """Read the timing and error statistics of the SPI Adapter. The statistics cover
+        the commands since the SPI Adapter started or since the last reset.
+
+        :param reset: If True, the statistics are reset after reading them.
+        :type reset: bool
+
+        :returns: If error, returns None, otherwise the statistics.
+        :rtype: AdapterStats | None
+        """
+        assert isinstance(reset, bool)
+        req = bytearray()
+        req.append(ord("x"))
+        req.append(0b1 if reset else 0b0)
+        self.__serial.write(req)
+
+        ok_resp = self.__read_adapter_response("Stats", 1)
         if ok_resp is None:
             return None
 
-        # Here response was OK. Get the count of returned data bytes read from the device.
-        resp_count = (ok_resp[0] << 8) + ok_resp[1]
-        expected_resp_count = len(data) + extra_bytes if read else 0
-        if resp_count != expected_resp_count:
-            print(
-                f"SPI read: response count mismatch, expected {expected_resp_count}, got {resp_count}",
-                flush=True,
-            )
+        def read_uint32s(n: int) -> List[int] | None:
+            resp = self.__serial.read(4 * n)
+            if len(resp) != 4 * n:
+                print(f"Stats: data read mismatch, expected {4 * n}, got {len(resp)}", flush=True)
+                return None
+            return [int.from_bytes(resp[i : i + 4], byteorder="big") for i in range(0, 4 * n, 4)]
+
+        num_phases = ok_resp[0]
+        phases = []
+        for _ in range(num_phases):
+            values = read_uint32s(4)
+            if values is None:
+                return None
+            phases.append(TimingSummary(*values))
+        if len(phases) < 3:
+            print(f"Stats: unexpected number of phases: {num_phases}", flush=True)
+            return None
+        counters = read_uint32s(2)
+        if counters is None:
             return None
+        resp = self.__serial.read(1)
+        if len(resp) != 1:
+            print("Stats: failed to read the number of commands", flush=True)
+            return None
+        commands = {}
+        for _ in range(resp[0]):
+            selector = self.__serial.read(1)
+            values = read_uint32s(5)
+            if len(selector) != 1 or values is None:
+                return None
+            commands[selector.decode()] = (TimingSummary(*values[0:4]), values[4])
+        return AdapterStats(
+            receive=phases[0],
+            spi=phases[1],
+            transmit=phases[2],
+            timeouts=counters[0],
+            unknown_commands=counters[1],
+            commands=commands,
+        )
 
-        # Read the data bytes
-        resp = self.__serial.read(resp_count)
+    def read_trace(self, clear: bool = False) -> List[TraceEntry] | None:
+        """Read the SPI Adapter's trace of the recent commands. The SPI Adapter keeps the last
+        256 commands. Use ``print()`` on the entries for a human readable dump.
+
+        :param clear: If True, the trace is cleared after reading it.
+        :type clear: bool
+
+        :returns: If error, returns None, otherwise the trace entries, oldest first.
+        :rtype: List[TraceEntry] | None
+        """
+        assert isinstance(clear, bool)
+        req = bytearray()
+        req.append(ord("l"))
+        req.append(0b1 if clear else 0b0)
+        self.__serial.write(req)
+
+        ok_resp = self.__read_adapter_response("Trace", 3)
+        if ok_resp is None:
+            return None
+        count = (ok_resp[0] << 8) + ok_resp[1]
+        entry_size = ok_resp[2]
+        resp = self.__serial.read(count * entry_size)
         assert isinstance(resp, bytes), type(resp)
-        if len(resp) != resp_count:
+        if len(resp) != count * entry_size:
             print(
-                f"SPI read: data read mismatch, expected {resp_count}, got {len(resp)}",
+                f"Trace: data read mismatch, expected {count * entry_size}, got {len(resp)}",
                 flush=True,
             )
             return None
-        return bytearray(resp)
+        return decode_trace(resp, entry_size)
+
+    def store_init_script(self, script: InitScript | None) -> bool:
+        """Stores an init script in the SPI Adapter's flash, replacing the current one. The
+        SPI Adapter runs the script on each startup, before the host connects.
+
+        :param script: The script to store, or None to clear the current one.
+        :type script: InitScript | None
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        assert script is None or isinstance(script, InitScript)
+        req = bytearray()
+        req.append(ord("u"))
+        if script is None:
+            req.append(ord("c"))
+        else:
+            data = script.data()
+            req.append(ord("s"))
+            req.extend(len(data).to_bytes(2, byteorder="big"))
+            req.extend(data)
+        self.__serial.write(req)
+        # The SPI Adapter erases and programs a 4KB flash sector, typically in
+        # about 50ms, but up to about 0.5s per the flash's max sector erase and
+        # page program times.
+        saved_timeout = self.__serial.timeout
+        self.__serial.timeout = max(saved_timeout, 2.0)
+        try:
+            ok_resp = self.__read_adapter_response("Init script", 0)
+        finally:
+            self.__serial.timeout = saved_timeout
+        return ok_resp is not None
+
+    def read_init_script(self) -> bytes | None:
+        """Reads the init script that is stored in the SPI Adapter.
+
+        :returns: The script data, as returned by :func:`InitScript.data`, an empty
+           ``bytes`` if there is no script, or None if an error.
+        :rtype: bytes | None
+        """
+        req = bytearray()
+        req.append(ord("u"))
+        req.append(ord("r"))
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Init script", 2)
+        if ok_resp is None:
+            return None
+        n = int.from_bytes(ok_resp, byteorder="big")
+        data = self.__serial.read(n)
+        assert isinstance(data, bytes), type(data)
+        if len(data) != n:
+            print(f"Init script: data read mismatch, expected {n}, got {len(data)}", flush=True)
+            return None
+        return data
+
+    def set_cs_timing(
+        self, cs: int, setup_ns: int = 0, hold_ns: int = 0, gap_ns: int = 0
+    ) -> bool:
+        """Sets the timing requirements of the device at the given CS. The SPI Adapter enforces
+        them on all the transactions with that CS, using busy waits, so the device can run at
+        the fastest timing its datasheet allows. All the times are initially zero.
+
+        :param cs: The Chip Select (CS) output index, in the range [0, 3].
+        :type cs: int
+
+        :param setup_ns: Min time in nsecs from CS assertion to the first clock edge. In the
+            range [0, 10000000].
+        :type setup_ns: int
+
+        :param hold_ns: Min time in nsecs from the last clock edge to CS release. In the
+            range [0, 10000000].
+        :type hold_ns: int
+
+        :param gap_ns: Min time in nsecs from CS release to the next CS assertion. In the
+            range [0, 10000000].
+        :type gap_ns: int
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        req = _cs_timing_request(cs, setup_ns, hold_ns, gap_ns)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("CS timing", 0)
+        if ok_resp is None:
+            return False
+        return True
 
     def set_aux_pin_mode(self, pin: int, pin_mode: AuxPinMode) -> bool:
         """Sets the mode of an auxilary pin.
@@ -205,13 +1666,7 @@ class SpiAdapter:
         :returns: True if OK, False otherwise.
         :rtype: bool
         """
-        assert isinstance(pin, int)
-        assert 0 <= pin <= 7
-        assert isinstance(pin_mode, AuxPinMode)
-        req = bytearray()
-        req.append(ord("m"))
-        req.append(pin)
-        req.append(pin_mode.value)
+        req = _aux_mode_request(pin, pin_mode)
         self.__serial.write(req)
         ok_resp = self.__read_adapter_response("Aux mode", 0)
         if ok_resp is None:
@@ -245,14 +1700,7 @@ class SpiAdapter:
         :returns: True if OK, False otherwise.
         :rtype: bool
         """
-        assert isinstance(values, int)
-        assert 0 <= values <= 255
-        assert isinstance(mask, int)
-        assert 0 <= mask <= 255
-        req = bytearray()
-        req.append(ord("b"))
-        req.append(values)
-        req.append(mask)
+        req = _aux_write_request(values, mask)
         self.__serial.write(req)
         ok_resp = self.__read_adapter_response("Aux write", 0)
         if ok_resp is None:
@@ -294,6 +1742,280 @@ class SpiAdapter:
         pin_value_mask = pin_mask if value else 0
         return self.write_aux_pins(pin_value_mask, pin_mask)
 
+    def play_aux_waveform(
+        self, entries: List[Tuple[int, int]], mask: int = 0b11111111
+    ) -> bool:
+        """Plays a waveform on the aux pins. The waveform is uploaded to the SPI Adapter
+        which plays it with a microsecond resolution, independently of the USB communication.
+        The method returns once the playback started. The aux pins that are selected by
+        ``mask`` are switched to outputs and retain the values of the last entry when the
+        playback ends.
+
+        :param entries: A list of up to 256 ``(values, duration_us)`` tuples. ``values`` is an
+            8 bits int with the aux pins values, in the range [0, 255], and ``duration_us``
+            is the time the values are held, in the range [4, 16777215] usecs.
+        :type entries: List[Tuple[int, int]]
+
+        :param mask: An 8 bits int that selects the aux pins to drive. Should be non zero.
+        :type mask: int
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        assert isinstance(entries, list)
+        assert 1 <= len(entries) <= 256
+        assert isinstance(mask, int)
+        assert 0 < mask <= 255
+        req = bytearray()
+        req.append(ord("w"))
+        req.append(1)
+        req.append(mask)
+        req.append(len(entries) // 256)
+        req.append(len(entries) % 256)
+        for values, duration_us in entries:
+            assert isinstance(values, int)
+            assert 0 <= values <= 255
+            assert isinstance(duration_us, int)
+            assert 4 <= duration_us <= 0xFFFFFF
+            req.append(values)
+            req.extend(duration_us.to_bytes(3, byteorder="big"))
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux waveform", 0)
+        if ok_resp is None:
+            return False
+        return True
+
+    def is_aux_waveform_playing(self) -> bool | None:
+        """Tests if an aux waveform playback is in progress.
+
+        :returns: True if playing, False if not, None if an error.
+        :rtype: bool | None
+        """
+        req = bytearray()
+        req.append(ord("w"))
+        req.append(2)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux waveform status", 1)
+        if ok_resp is None:
+            return None
+        return ok_resp[0] != 0
+
+    def stop_aux_waveform(self) -> bool:
+        """Stops the aux waveform playback, if any. The aux pins retain their current values.
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        req = bytearray()
+        req.append(ord("w"))
+        req.append(3)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux waveform stop", 0)
+        if ok_resp is None:
+            return False
+        return True
+
+    def start_aux_capture(
+        self,
+        sample_rate: int,
+        num_samples: int,
+        trigger_pin: int | None = None,
+        trigger_rising_edge: bool = True,
+    ) -> bool:
+        """Starts capturing the aux pins, similar to a logic analyzer. The SPI Adapter
+        samples the eight aux pins at the given rate into its internal buffer. Use
+        :func:`get_aux_capture_status` to track the capture and :func:`read_aux_capture`
+        to fetch the samples once it's done.
+
+        :param sample_rate: The sample rate in Hz, in the range [2000, 125000000].
+        :type sample_rate: int
+
+        :param num_samples: Number of samples to capture. Should be a multiple of 4
+            in the range [4, 65536].
+        :type num_samples: int
+
+        :param trigger_pin: If not None, the capture starts on an edge of this
+            aux pin, otherwise it starts immediately.
+        :type trigger_pin: int | None
+
+        :param trigger_rising_edge: Selects the rising or falling edge of ``trigger_pin``.
+        :type trigger_rising_edge: bool
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        assert isinstance(sample_rate, int)
+        assert 2000 <= sample_rate <= 125000000
+        assert isinstance(num_samples, int)
+        assert 4 <= num_samples <= 65536
+        assert num_samples % 4 == 0
+        assert trigger_pin is None or 0 <= trigger_pin <= 7
+        assert isinstance(trigger_rising_edge, bool)
+        trigger_config = 0
+        if trigger_pin is not None:
+            trigger_config = 0b10000000 | trigger_pin
+            if trigger_rising_edge:
+                trigger_config |= 0b01000000
+        req = bytearray()
+        req.append(ord("c"))
+        req.append(1)
+        req.extend(sample_rate.to_bytes(4, byteorder="big"))
+        req.extend(num_samples.to_bytes(4, byteorder="big"))
+        req.append(trigger_config)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux capture start", 0)
+        if ok_resp is None:
+            return False
+        return True
+
+    def get_aux_capture_status(self) -> Tuple[AuxCaptureState, int] | None:
+        """Returns the status of the aux pins capture.
+
+        :returns: A tuple with the capture state and the number of samples captured so far,
+            or None if an error.
+        :rtype: Tuple[AuxCaptureState, int] | None
+        """
+        req = bytearray()
+        req.append(ord("c"))
+        req.append(2)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux capture status", 5)
+        if ok_resp is None:
+            return None
+        state = AuxCaptureState(ok_resp[0])
+        samples_captured = int.from_bytes(ok_resp[1:5], byteorder="big")
+        return (state, samples_captured)
+
+    def read_aux_capture(self) -> bytearray | None:
+        """Reads the samples of a completed aux pins capture.
+
+        :returns: The samples, one byte per sample with aux pin 0 at bit 0, or None if
+            an error or if the capture is not completed.
+        :rtype: bytearray | None
+        """
+        req = bytearray()
+        req.append(ord("c"))
+        req.append(3)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux capture read", 4)
+        if ok_resp is None:
+            return None
+        resp_count = int.from_bytes(ok_resp, byteorder="big")
+        resp = self.__serial.read(resp_count)
+        assert isinstance(resp, bytes), type(resp)
+        if len(resp) != resp_count:
+            print(
+                f"Aux capture read: data read mismatch, expected {resp_count}, got {len(resp)}",
+                flush=True,
+            )
+            return None
+        return bytearray(resp)
+
+    def stop_aux_capture(self) -> bool:
+        """Aborts the current aux pins capture, if any.
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        req = bytearray()
+        req.append(ord("c"))
+        req.append(4)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux capture stop", 0)
+        if ok_resp is None:
+            return False
+        return True
+
+    def subscribe_aux_events(
+        self, mask: int, callback: Callable[[AuxEvent], None] | None = None
+    ) -> bool:
+        """Selects the aux pins whose changes are reported by the SPI Adapter. The changes
+        are detected by the SPI Adapter using interrupts and are sent to the driver as
+        timestamped events, with no polling. Events are delivered to ``callback``, if
+        specified, otherwise they are queued and can be retrieved with :func:`get_aux_events`.
+        Events are processed whenever the driver reads a response from the SPI Adapter or
+        when :func:`get_aux_events` is called.
+
+        :param mask: An 8 bits int with the aux pins to watch. Zero to stop watching.
+        :type mask: int
+
+        :param callback: An optional function that is called with each :class:`AuxEvent`.
+        :type callback: Callable[[AuxEvent], None] | None
+
+        :returns: True if OK, False otherwise.
+        :rtype: bool
+        """
+        assert isinstance(mask, int)
+        assert 0 <= mask <= 255
+        self.__aux_event_callback = callback
+        req = bytearray()
+        req.append(ord("n"))
+        req.append(mask)
+        self.__serial.write(req)
+        ok_resp = self.__read_adapter_response("Aux notify", 0)
+        if ok_resp is None:
+            return False
+        if not mask:
+            self.__aux_events.clear()
+        return True
+
+    def get_aux_events(self, timeout: float = 0.0) -> List[AuxEvent]:
+        """Returns the queued aux events and clears the queue. See :func:`subscribe_aux_events`.
+
+        :param timeout: Max time in seconds to wait for an event if none is pending. Zero for no
+            waiting.
+        :type timeout: float
+
+        :returns: The aux events, oldest first. Empty if none.
+        :rtype: List[AuxEvent]
+        """
+        assert isinstance(timeout, (int, float))
+        assert timeout >= 0
+        deadline = time.monotonic() + timeout
+        while True:
+            # Process the messages that already arrived.
+            while self.__serial.in_waiting:
+                if self.__serial.read(1) != b"!" or not self.__read_aux_event_message():
+                    print("Aux events: unexpected data from adapter", flush=True)
+                    break
+            time_left = deadline - time.monotonic()
+            if self.__aux_events or time_left <= 0:
+                break
+            # Wait for the next message.
+            saved_timeout = self.__serial.timeout
+            self.__serial.timeout = time_left
+            first_byte = self.__serial.read(1)
+            self.__serial.timeout = saved_timeout
+            if first_byte == b"!":
+                self.__read_aux_event_message()
+            elif first_byte:
+                print("Aux events: unexpected data from adapter", flush=True)
+        result = list(self.__aux_events)
+        self.__aux_events.clear()
+        return result
+
+    def __read_aux_event_message(self) -> bool:
+        """Reads the rest of an aux event message, after the '!' marker, and
+        dispatches it. Returns True if OK."""
+        msg = self.__serial.read(7)
+        assert isinstance(msg, bytes), type(msg)
+        if len(msg) != 7:
+            print(f"Aux event: read mismatch, expected {7}, got {len(msg)}", flush=True)
+            return False
+        event = AuxEvent(
+            aux_pin=msg[0],
+            falling_edge=bool(msg[1] & 0b01),
+            rising_edge=bool(msg[1] & 0b10),
+            aux_values=msg[2],
+            timestamp_us=int.from_bytes(msg[3:7], byteorder="big"),
+            overflow=bool(msg[1] & 0b10000000),
+        )
+        if self.__aux_event_callback:
+            self.__aux_event_callback(event)
+        else:
+            self.__aux_events.append(event)
+        return True
+
     def test_connection_to_adapter(self, max_tries: int = 3) -> bool:
         """Tests connection to the SPI Adapter.
 
@@ -322,19 +2044,36 @@ class SpiAdapter:
         # All tries failed.
         return False
 
-    def __test_echo_cmd(self, b: int) -> bool:
-        """Test if an echo command with given byte returns the same byte. Used
-        to test the connection to the driver."""
+    def echo(self, b: int) -> int | None:
+        """Send a byte to the SPI Adapter and return the byte it echoes back. This is the
+        smallest round trip to the SPI Adapter and is useful for diagnostics and for
+        measuring the latency of the connection.
+
+        :param b: The byte to send, in the range [0, 255].
+        :type b: int
+
+        :returns: The echoed byte, or None if no response.
+        :rtype: int | None
+        """
         assert isinstance(b, int)
-        assert 0 <= b <= 256
+        assert 0 <= b <= 255
         req = bytearray()
         req.append(ord("e"))
         req.append(b)
         self.__serial.write(req)
         resp = self.__serial.read(1)
         assert isinstance(resp, bytes), type(resp)
-        assert len(resp) == 1
-        return resp[0] == b
+        # Skip aux event messages, unless we echo the event marker itself.
+        while b != ord("!") and resp == b"!" and self.__read_aux_event_message():
+            resp = self.__serial.read(1)
+        if len(resp) != 1:
+            return None
+        return resp[0]
+
+    def __test_echo_cmd(self, b: int) -> bool:
+        """Test if an echo command with given byte returns the same byte. Used
+        to test the connection to the driver."""
+        return self.echo(b) == b
 
     def __read_adapter_info(self) -> Optional[bytearray]:
         """Return adapter info or None if an error."""
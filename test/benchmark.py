@@ -0,0 +1,159 @@
+# Benchmarks of the SPI Adapter latency and throughput.
+#
+# Runs a fixed set of measurements and prints a summary with percentiles.
+# The results can also be written to a JSON file, to compare firmware and
+# driver versions.
+#
+# Usage:
+#   python benchmark.py --port COM18 --output results.json
+#
+# The measurements don't require devices to be connected, but note that
+# SEND transactions assert the CS outputs and toggle the SPI pins.
+
+import argparse
+import json
+import platform
+import statistics
+import sys
+import time
+from typing import Callable, Dict, List
+
+sys.path.insert(0, "../src/")
+from spi_adapter import SpiAdapter, AuxPinMode
+
+
+def percentile(sorted_values: List[float], p: float) -> float:
+    """Returns the p percentile of a sorted list, with linear interpolation."""
+    assert sorted_values
+    k = (len(sorted_values) - 1) * p / 100
+    f = int(k)
+    c = min(f + 1, len(sorted_values) - 1)
+    return sorted_values[f] + (sorted_values[c] - sorted_values[f]) * (k - f)
+
+
+def time_op(op: Callable[[], None], iterations: int, warmup: int = 5) -> Dict[str, float]:
+    """Times an operation and returns a summary of its durations, in usecs."""
+    for _ in range(warmup):
+        op()
+    durations = []
+    for _ in range(iterations):
+        start = time.perf_counter()
+        op()
+        durations.append((time.perf_counter() - start) * 1e6)
+    durations.sort()
+    return {
+        "iterations": iterations,
+        "mean_us": statistics.mean(durations),
+        "min_us": durations[0],
+        "p50_us": percentile(durations, 50),
+        "p90_us": percentile(durations, 90),
+        "p99_us": percentile(durations, 99),
+        "max_us": durations[-1],
+    }
+
+
+def add_throughput(result: Dict[str, float], num_bytes: int) -> Dict[str, float]:
+    """Adds the throughput, in bytes/sec, based on the mean duration."""
+    result["bytes"] = num_bytes
+    result["bytes_per_sec"] = num_bytes / (result["mean_us"] / 1e6)
+    return result
+
+
+def run(spi: SpiAdapter, iterations: int) -> Dict[str, Dict[str, float]]:
+    results: Dict[str, Dict[str, float]] = {}
+
+    def check(ok: bool) -> None:
+        assert ok, "Operation failed"
+
+    # Round trip latency.
+    results["echo"] = time_op(lambda: check(spi.echo(0x5A) == 0x5A), iterations)
+    results["send_1_byte"] = time_op(
+        lambda: check(spi.send(bytes([0x00]), speed=4000000) is not None), iterations
+    )
+
+    # Throughput vs transaction size.
+    for n in [1, 2, 4, 8, 16, 32, 64, 128, 256]:
+        data = bytes(n)
+        results[f"send_{n}_bytes_4mhz"] = add_throughput(
+            time_op(lambda: check(spi.send(data, speed=4000000) is not None), iterations), n
+        )
+
+    # Transactions larger than a single SEND, split with a held CS.
+    for n in [1024, 4096]:
+        data = bytes(256)
+
+        def large_send() -> None:
+            for i in range(n // 256):
+                hold_cs = i < n // 256 - 1
+                check(spi.send(data, speed=4000000, hold_cs=hold_cs) is not None)
+
+        results[f"send_{n}_bytes_4mhz"] = add_throughput(
+            time_op(large_send, max(1, iterations // 10)), n
+        )
+
+    # Throughput vs clock speed.
+    data = bytes(256)
+    for speed in [250000, 1000000, 2000000, 4000000]:
+        results[f"send_256_bytes_{speed // 1000}khz"] = add_throughput(
+            time_op(lambda: check(spi.send(data, speed=speed) is not None), iterations), 256
+        )
+
+    # Read vs no read.
+    results["send_256_bytes_no_read"] = add_throughput(
+        time_op(lambda: check(spi.send(data, speed=4000000, read=False) is not None), iterations),
+        256,
+    )
+
+    # Aux ops rate.
+    check(spi.set_aux_pin_mode(7, AuxPinMode.OUTPUT))
+    results["aux_write"] = time_op(lambda: check(spi.write_aux_pin(7, 1)), iterations)
+    results["aux_read"] = time_op(lambda: check(spi.read_aux_pins() is not None), iterations)
+    check(spi.set_aux_pin_mode(7, AuxPinMode.INPUT_PULLUP))
+
+    return results
+
+
+def print_results(results: Dict[str, Dict[str, float]]) -> None:
+    print(
+        f"{'benchmark':30s} {'mean':>9s} {'p50':>9s} {'p90':>9s} {'p99':>9s} {'max':>9s}  {'KB/s':>8s}"
+    )
+    for name, r in results.items():
+        rate = f"{r['bytes_per_sec'] / 1000:8.1f}" if "bytes_per_sec" in r else ""
+        print(
+            f"{name:30s} {r['mean_us']:9.0f} {r['p50_us']:9.0f} {r['p90_us']:9.0f} "
+            f"{r['p99_us']:9.0f} {r['max_us']:9.0f}  {rate}"
+        )
+    print("(times in usecs)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SPI Adapter benchmarks.")
+    parser.add_argument("--port", required=True, help="Serial port of the SPI Adapter.")
+    parser.add_argument("--iterations", type=int, default=200, help="Iterations per benchmark.")
+    parser.add_argument("--output", help="Optional JSON file to write the results to.")
+    parser.add_argument("--label", default="", help="Optional label to store with the results.")
+    args = parser.parse_args()
+
+    print(f"Connecting to port {args.port}...", flush=True)
+    spi = SpiAdapter(port=args.port)
+    print("Connected.", flush=True)
+
+    results = run(spi, args.iterations)
+    print_results(results)
+
+    if args.output:
+        report = {
+            "label": args.label,
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "host": platform.platform(),
+            "python": platform.python_version(),
+            "port": args.port,
+            "results": results,
+        }
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+        print(f"Results written to {args.output}", flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,179 @@
+# Load test of the drivers against the firmware simulator and its device
+# models, see firmware/sim.
+#
+# Starts the simulator with an ADS1118 ADC, an AD9833 DDS, an SSD1306 OLED
+# and a NOR flash on CS 0-3, drives each of them at full rate for a given
+# time, checks the results and prints the end to end throughput.
+#
+# Usage:
+#   (cd ../firmware/sim && make)
+#   python sim_load.py --seconds 5
+
+import argparse
+import random
+import re
+import signal
+import subprocess
+import sys
+import time
+from typing import Callable, Dict, List
+
+sys.path.insert(0, "../src/")
+from spi_adapter import SpiAdapter, AuxPinMode
+
+# Device setup, per the specs of the simulator's --device flag.
+ADC_CS = 0
+ADC_AIN0_MV = 1000
+DDS_CS = 1
+OLED_CS = 2
+OLED_DC_AUX_PIN = 0
+FLASH_CS = 3
+FLASH_SIZE_KB = 4096
+
+DEVICES = [
+    f"{ADC_CS}=ads1118:ain0={ADC_AIN0_MV}",
+    f"{DDS_CS}=ad9833",
+    f"{OLED_CS}=ssd1306:dc={OLED_DC_AUX_PIN}",
+    f"{FLASH_CS}=flash:size_kb={FLASH_SIZE_KB}",
+]
+
+
+def run_for(seconds: float, op: Callable[[], int]) -> Dict[str, float]:
+    """Repeats an operation for the given time. The operation returns the
+    number of payload bytes it transferred."""
+    ops = 0
+    num_bytes = 0
+    start = time.perf_counter()
+    while (elapsed := time.perf_counter() - start) < seconds:
+        num_bytes += op()
+        ops += 1
+    return {"ops": ops, "ops_per_sec": ops / elapsed, "bytes_per_sec": num_bytes / elapsed}
+
+
+def adc_op(spi: SpiAdapter) -> Callable[[], int]:
+    """Single shot conversions of AIN0, 2.048V full scale, as in adc_demo.py."""
+    cmd = bytes([0b11000101, 0b10001010, 0x00, 0x00])
+    expected = ADC_AIN0_MV * 32768 // 2048
+    # The first response has the result of the previous conversion.
+    spi.send(cmd, cs=ADC_CS, mode=1, speed=4000000)
+
+    def op() -> int:
+        resp = spi.send(cmd, cs=ADC_CS, mode=1, speed=4000000)
+        assert resp is not None
+        value = int.from_bytes(resp[0:2], byteorder="big", signed=True)
+        assert value == expected, f"{value=}, {expected=}"
+        return len(cmd)
+
+    return op
+
+
+def dds_words(freq_hz: int) -> bytes:
+    """Command words that set the DDS frequency, as in dds.py."""
+    reg = int((1 << 28) * freq_hz / 25_000_000)
+    words = [1 << 13, (1 << 14) | (reg & 0x3FFF), (1 << 14) | (reg >> 14)]
+    return b"".join(w.to_bytes(2, "big") for w in words)
+
+
+def dds_op(spi: SpiAdapter, last_freq: List[int]) -> Callable[[], int]:
+    def op() -> int:
+        last_freq[0] = random.randrange(0, 20000)
+        data = dds_words(last_freq[0])
+        assert spi.send(data, cs=DDS_CS, mode=2, speed=4000000, read=False) is not None
+        return len(data)
+
+    return op
+
+
+def oled_op(spi: SpiAdapter, last_frame: List[bytes]) -> Callable[[], int]:
+    """Full frame updates where a part of the frame changes each time."""
+    assert spi.set_aux_pin_mode(OLED_DC_AUX_PIN, AuxPinMode.OUTPUT)
+    frame = bytearray(random.randbytes(128 * 8))
+
+    def op() -> int:
+        start = random.randrange(0, len(frame) - 64)
+        frame[start : start + 64] = random.randbytes(64)
+        sent = spi.update_display(frame, OLED_DC_AUX_PIN, cs=OLED_CS, speed=4000000)
+        assert sent is not None
+        last_frame[0] = bytes(frame)
+        return sent
+
+    return op
+
+
+def flash_op(spi: SpiAdapter) -> Callable[[], int]:
+    """Erase, program and read back of 4KB sectors."""
+    jedec_id = spi.flash_read_jedec_id(cs=FLASH_CS)
+    assert jedec_id is not None and jedec_id[0] == 0xEF, jedec_id
+    sector = [0]
+
+    def op() -> int:
+        addr = (sector[0] * 4096) % (FLASH_SIZE_KB * 1024)
+        sector[0] += 1
+        data = random.randbytes(4096)
+        assert spi.flash_erase(addr, cs=FLASH_CS)
+        assert spi.flash_program(addr, data, cs=FLASH_CS)
+        assert spi.flash_read(addr, len(data), cs=FLASH_CS) == data
+        return 2 * len(data)
+
+    return op
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SPI Adapter simulator load test.")
+    parser.add_argument(
+        "--sim", default="../firmware/sim/build/spi_adapter_sim", help="Simulator executable."
+    )
+    parser.add_argument("--seconds", type=float, default=5, help="Duration of each workload.")
+    args = parser.parse_args()
+
+    cmd = [args.sim]
+    for device in DEVICES:
+        cmd += ["--device", device]
+    sim = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    port = None
+    try:
+        line = sim.stdout.readline()
+        match = re.search(r"serial port: (\S+)", line)
+        assert match, f"Unexpected simulator output: {line!r}"
+        port = match.group(1)
+        print(f"Simulator serial port: {port}", flush=True)
+
+        spi = SpiAdapter(port=port)
+        last_freq = [0]
+        last_frame = [b""]
+        workloads = {
+            "adc": adc_op(spi),
+            "dds": dds_op(spi, last_freq),
+            "oled": oled_op(spi, last_frame),
+            "flash": flash_op(spi),
+        }
+        print(f"{'workload':10s} {'ops':>8s} {'ops/s':>10s} {'KB/s':>10s}")
+        for name, op in workloads.items():
+            r = run_for(args.seconds, op)
+            print(
+                f"{name:10s} {r['ops']:8d} {r['ops_per_sec']:10.1f} "
+                f"{r['bytes_per_sec'] / 1000:10.1f}",
+                flush=True,
+            )
+    finally:
+        sim.send_signal(signal.SIGINT)
+        summary = sim.communicate(timeout=10)[0]
+
+    print("\nDevice summaries:")
+    print(summary, end="")
+
+    # Check the final device states.
+    errors = re.findall(r"mode_errors=(\d+)", summary)
+    assert errors and all(e == "0" for e in errors), "SPI mode errors"
+    output_hz = float(re.search(r"output=([\d.]+)Hz", summary).group(1))
+    expected_hz = int((1 << 28) * last_freq[0] / 25_000_000) * 25_000_000 / (1 << 28)
+    assert abs(output_hz - expected_hz) < 0.01, f"{output_hz=}, {expected_hz=}"
+    lit_pixels = int(re.search(r"lit_pixels=(\d+)", summary).group(1))
+    expected_pixels = sum(bin(b).count("1") for b in last_frame[0])
+    assert lit_pixels == expected_pixels, f"{lit_pixels=}, {expected_pixels=}"
+    assert "rejected=0" in summary, "Rejected flash commands"
+    print("All checks passed.")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,145 @@
+# Regression test of commands that arrive in several USB packets, against
+# the firmware simulator, see firmware/sim.
+#
+# Sends each command once in a single write, to get the expected response,
+# and then split in two writes at each byte offset, with a pause between
+# them so the firmware loop sees a partial command. The second write also
+# has a pipelined INFO command, which a handler that reads past its
+# command would swallow. Checks that each split command and the INFO
+# command get the expected responses, with no extra bytes.
+#
+# Usage:
+#   (cd ../firmware/sim && make)
+#   python sim_split_write.py
+
+import argparse
+import re
+import signal
+import subprocess
+import sys
+import time
+from serial import Serial
+
+sys.path.insert(0, "../src/")
+from spi_adapter import AuxPinMode, _aux_mode_request, _send_request
+
+# Pause between the two parts of a split command. Well below the firmware's
+# 250ms command timeout.
+SPLIT_PAUSE_SECS = 0.02
+# Max time to wait for a response.
+RESPONSE_TIMEOUT_SECS = 0.2
+
+# Device setup, per the specs of the simulator's --device flag.
+FLASH_CS = 3
+DEVICES = [f"{FLASH_CS}=flash:size_kb=64"]
+
+
+def flash_request(op: str, args: bytes) -> bytes:
+    """A FLASH request for the flash at FLASH_CS, at 4MHz."""
+    return b"f" + op.encode() + bytes([FLASH_CS, 160]) + args
+
+
+# Name and request bytes of each command.
+COMMANDS = [
+    ("SEND", _send_request(bytes(range(1, 11)), 2, 0, 0, 1000000, True, False, 8, False)),
+    (
+        "SEND word format",
+        _send_request(bytes(range(1, 13)), 4, 1, 1, 1000000, True, False, 16, True),
+    ),
+    (
+        "SEND broadcast",
+        _send_request(bytes(range(1, 9)), 0, [0, 2], 0, 1000000, False, False, 8, False),
+    ),
+    ("FLASH jedec id", flash_request("j", b"")),
+    ("FLASH erase", flash_request("e", bytes([0]) + (4096).to_bytes(4, "big"))),
+    # Crosses a page boundary.
+    (
+        "FLASH program",
+        flash_request("p", (4096 + 200).to_bytes(4, "big") + (100).to_bytes(4, "big"))
+        + bytes(range(100)),
+    ),
+    (
+        "FLASH read",
+        flash_request("r", (4096 + 200).to_bytes(4, "big") + (100).to_bytes(4, "big")),
+    ),
+    # Three entries of 100us on aux pin 0.
+    (
+        "WAVEFORM start",
+        b"w\x01\x01" + (3).to_bytes(2, "big") + b"".join(bytes([v, 0, 0, 100]) for v in (1, 0, 1)),
+    ),
+    ("WAVEFORM status", b"w\x02"),
+    # 8 samples at 10KHz, no trigger.
+    ("CAPTURE start", b"c\x01" + (10000).to_bytes(4, "big") + (8).to_bytes(4, "big") + b"\x00"),
+    ("CAPTURE read", b"c\x03"),
+    # A script that sets aux pin 1 to output.
+    ("INIT SCRIPT store", b"us\x00\x03" + _aux_mode_request(1, AuxPinMode.OUTPUT)),
+    ("INIT SCRIPT read", b"ur"),
+]
+
+
+def read_response(serial: Serial) -> bytes:
+    """Reads bytes until none arrive for a while."""
+    resp = bytearray()
+    deadline = time.monotonic() + RESPONSE_TIMEOUT_SECS
+    while time.monotonic() < deadline:
+        if serial.in_waiting:
+            resp.extend(serial.read(serial.in_waiting))
+            deadline = time.monotonic() + 0.05
+        else:
+            time.sleep(0.001)
+    return bytes(resp)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SPI Adapter split command test.")
+    parser.add_argument(
+        "--sim", default="../firmware/sim/build/spi_adapter_sim", help="Simulator executable."
+    )
+    args = parser.parse_args()
+
+    cmd = [args.sim]
+    for device in DEVICES:
+        cmd += ["--device", device]
+    sim = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    failures = 0
+    try:
+        line = sim.stdout.readline()
+        match = re.search(r"serial port: (\S+)", line)
+        assert match, f"Unexpected simulator output: {line!r}"
+        serial = Serial(match.group(1), timeout=RESPONSE_TIMEOUT_SECS)
+
+        serial.write(b"i")
+        info_resp = read_response(serial)
+        assert info_resp.startswith(b"KSPI"), f"Unexpected INFO response {info_resp.hex(' ')}"
+
+        for name, req in COMMANDS:
+            serial.write(req)
+            expected = read_response(serial)
+            assert expected.startswith(b"K"), f"{name}: unexpected response {expected.hex(' ')}"
+            expected += info_resp
+            for split in range(1, len(req)):
+                serial.write(req[:split])
+                time.sleep(SPLIT_PAUSE_SECS)
+                serial.write(req[split:] + b"i")
+                resp = read_response(serial)
+                if resp != expected:
+                    print(
+                        f"{name}, split after {split} bytes: expected {expected.hex(' ')}, "
+                        f"got {resp.hex(' ')}",
+                        flush=True,
+                    )
+                    failures += 1
+                    # Let a partial command time out before the next one.
+                    time.sleep(0.3)
+                    serial.reset_input_buffer()
+            print(f"{name}: {len(req) - 1} splits", flush=True)
+    finally:
+        sim.send_signal(signal.SIGINT)
+        sim.communicate(timeout=10)
+
+    assert not failures, f"{failures} failed splits"
+    print("All checks passed.")
+
+
+if __name__ == "__main__":
+    main()